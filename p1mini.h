@@ -23,10 +23,155 @@
 //-------------------------------------------------------------------------------------
 
 #include "esphome.h"
+#include <cinttypes>
+#include <cstdarg>
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+#include <WiFiClient.h>
+#include <WiFiServer.h>
+#include <WiFiUdp.h>
+#endif
+
+// A value as received from the meter, mantissa * 10^exponent. Values are kept as integers
+// from parsing until they are handed to a sensor since the ESP8266 has no FPU, and so that
+// large cumulative registers are not rounded before they have to be.
+struct P1Decimal {
+    int64_t mantissa;
+    int8_t exponent;
+
+    // Conversion to float is done once, right before publishing. The integer and fractional
+    // parts are converted separately so that the scaling itself is exact. Values that do not
+    // fit in an integer with the exponent applied are scaled in floating point instead.
+    float ToFloat() const
+    {
+        if (exponent >= 0) {
+            int64_t scaled;
+            if (ToMantissa(0, scaled)) return static_cast<float>(scaled);
+            return static_cast<float>(mantissa) * powf(10.0f, exponent);
+        }
+        if (-exponent > max_exponent) return static_cast<float>(mantissa) * powf(10.0f, exponent);
+        int64_t const divisor{ PowerOfTen(-exponent) };
+        return static_cast<float>(mantissa / divisor) + static_cast<float>(mantissa % divisor) / static_cast<float>(divisor);
+    }
+
+    // The value as a mantissa for another exponent (digits below it are dropped). Returns
+    // false if it does not fit in the mantissa.
+    bool ToMantissa(int target_exponent, int64_t &result) const
+    {
+        if (exponent < target_exponent) {
+            // No mantissa has 19 digits or more
+            int const shift{ target_exponent - exponent };
+            result = shift > max_exponent ? 0 : mantissa / PowerOfTen(shift);
+            return true;
+        }
+        int const shift{ exponent - target_exponent };
+        if (mantissa == 0 || shift == 0) {
+            result = mantissa;
+            return true;
+        }
+        if (shift > max_exponent) return false;
+        int64_t const power{ PowerOfTen(shift) };
+        if (mantissa > INT64_MAX / power || mantissa < -(INT64_MAX / power)) return false;
+        result = mantissa * power;
+        return true;
+    }
+
+    // All powers of ten up to 10^max_exponent fit in the mantissa
+    constexpr static int max_exponent{ 18 };
+
+    // 10^exponent, for exponents from 0 to max_exponent
+    static int64_t PowerOfTen(int exponent)
+    {
+        constexpr static int64_t powers_of_ten[max_exponent + 1]{ 1, 10, 100, 1000, 10000, 100000, 1000000,
+            10000000, 100000000, 1000000000, 10000000000, 100000000000, 1000000000000, 10000000000000,
+            100000000000000, 1000000000000000, 10000000000000000, 100000000000000000, 1000000000000000000 };
+        return powers_of_ten[exponent];
+    }
+};
+
+// Time as sent by the meter, YYMMDDhhmmss followed by W (normal time) or S (summer time).
+struct P1Timestamp {
+    uint8_t year; // Since 2000
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+    bool dst;
+
+    // UTC offset in seconds. Swedish and DSMR meters use CET/CEST.
+    int32_t UTCOffset() const { return dst ? 7200 : 3600; }
+
+    // Seconds since 1970 (UTC). Unlike the local time, this keeps increasing when the clock
+    // is set back at the end of summer time.
+    uint32_t ToEpoch() const
+    {
+        // Days since 1970-01-01 for the proleptic Gregorian calendar (Howard Hinnant)
+        int const y{ 2000 + year - (month <= 2 ? 1 : 0) };
+        int const era{ y / 400 };
+        int const yoe{ y - era * 400 };
+        int const doy{ (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1 };
+        int const doe{ yoe * 365 + yoe / 4 - yoe / 100 + doy };
+        int32_t const days{ era * 146097 + doe - 719468 };
+        return static_cast<uint32_t>(days) * 86400 + hour * 3600 + minute * 60 + second - UTCOffset();
+    }
+
+    // ISO 8601, e.g. "2023-10-16T12:00:00+02:00". The buffer needs room for 26 characters.
+    void Format(char *buffer) const
+    {
+        sprintf(buffer, "20%02d-%02d-%02dT%02d:%02d:%02d+%02d:00", year, month, day, hour, minute, second, UTCOffset() / 3600);
+    }
+};
+
+// All values of one message, as they were when the message had been completely processed.
+// Values are in the unit sent by the meter. Values that are not sent in every message
+// (e.g. from submeters) are the latest received.
+struct P1Snapshot {
+    constexpr static int max_values{ 64 };
+    struct Value {
+        uint32_t code; // See P1Reader::OBIS
+        P1Decimal value;
+    };
+
+    uint32_t sequence; // Counts processed messages
+    uint32_t time; // Time of the message in seconds since 1970 (UTC), 0 if it is not sent
+    P1Timestamp timestamp; // The same in local time
+    int num_values;
+    Value values[max_values];
+
+    // The value for an OBIS code, or nullptr if there is none
+    P1Decimal const *Find(uint32_t code) const
+    {
+        for (int i = 0; i < num_values; ++i) {
+            if (values[i].code == code) return &values[i].value;
+        }
+        return nullptr;
+    }
+
+    // The value for an OBIS code, or NAN if there is none
+    float Get(uint32_t code) const
+    {
+        P1Decimal const *const value{ Find(code) };
+        return value == nullptr ? NAN : value->ToFloat();
+    }
+};
 
 class P1Reader : public Component, public UARTDevice {
 public:
 
+    // Combine the five values of an OBIS code A-B:C.D.E into a single unsigned int for
+    // easier handling and comparison. A (medium) and B (channel) get four bits each, which
+    // covers electricity (1) and the M-Bus channels (1-4) used by gas, water and heat meters.
+    constexpr static uint32_t OBIS(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e)
+    {
+        return (a & 0xf) << 28 | (b & 0xf) << 24 | (c & 0xff) << 16 | (d & 0xff) << 8 | (e & 0xff);
+    }
+
+    // Electricity values (1-0:major.minor.micro)
+    constexpr static uint32_t OBIS(uint32_t major, uint32_t minor, uint32_t micro)
+    {
+        return OBIS(1, 0, major, minor, micro);
+    }
+
     // Call from a lambda in the yaml file to set up each sensor.
     Sensor *AddSensor(int major, int minor, int micro)
     {
@@ -34,6 +179,226 @@ public:
         return m_sensor_list->GetSensor();
     }
 
+    // Same as above, with the full OBIS code, e.g. AddSensor(0, 1, 24, 2, 1) for the gas
+    // meter on M-Bus channel 1 of a DSMR meter.
+    Sensor *AddSensor(int a, int b, int major, int minor, int micro)
+    {
+        m_sensor_list = new SensorListItem(m_sensor_list, OBIS(a, b, major, minor, micro));
+        return m_sensor_list->GetSensor();
+    }
+
+#ifdef USE_TEXT_SENSOR
+    // Publish the capture time of a submeter value (e.g. the gas meter, 0-1:24.2.1) to a
+    // text sensor. The sensor for the value itself must have been added first.
+    void AddCaptureTimeSensor(TextSensor *sensor, int a, int b, int major, int minor, int micro)
+    {
+        SensorListItem *const item{ GetItem(OBIS(a, b, major, minor, micro)) };
+        if (item == nullptr) {
+            ESP_LOGE("p1reader", "No sensor for %d-%d:%d.%d.%d to add a capture time sensor to.", a, b, major, minor, micro);
+            return;
+        }
+        item->GetCaptureTime().sensor = sensor;
+    }
+
+    // Publish a text value, e.g. the meter ID (0-0:96.1.0) or the tariff indicator
+    // (0-0:96.14.0), to a text sensor. Values are only published when they change.
+    // Timestamps, such as the time of the message (0-0:1.0.0), are published in ISO 8601
+    // format.
+    void AddTextSensor(TextSensor *sensor, int a, int b, int major, int minor, int micro)
+    {
+        m_sensor_list = new SensorListItem(m_sensor_list, OBIS(a, b, major, minor, micro));
+        m_sensor_list->m_text = true;
+        m_sensor_list->m_text_state = new SensorListItem::Text{ sensor };
+    }
+#endif
+
+    // Time of the last message (0-0:1.0.0) in seconds since 1970 (UTC), or 0 if the meter
+    // does not send it.
+    uint32_t GetTelegramTime() const { return m_telegram_time; }
+
+    // Time of the message (as GetTelegramTime) that the latest value for an OBIS code was
+    // received in, or 0 if there is none. Values that are not sent in every message, e.g.
+    // from submeters, keep the time of the message they were last sent in.
+    uint32_t GetValueTime(uint32_t obis_code) const
+    {
+        SensorListItem const *const item{ GetItem(obis_code) };
+        return item != nullptr && item->m_has_value ? item->m_time : 0;
+    }
+
+    // Parse ASCII messages line by line as they are received instead of storing the whole
+    // message first. RAM use is then independent of the length of the message, but the
+    // message can not be passed on to the secondary P1 port. Streaming is switched on
+    // automatically if several messages in a row do not fit in the message buffer.
+    void SetStreaming(bool streaming) { m_streaming = streaming; }
+
+    // Create sensors for the OBIS codes in the first valid message that do not have a
+    // sensor already. Names, units and classes are taken from a built-in dictionary, so
+    // codes that are not in it are ignored. Can also be called after setup, but sensors are
+    // only discovered once.
+    void SetDiscovery(bool discovery)
+    {
+        if (discovery && m_discovered_table != nullptr) {
+            ESP_LOGE("p1reader", "Sensors have already been discovered.");
+            return;
+        }
+        m_discovery = discovery;
+        if (discovery && m_unmatched_codes == nullptr) {
+            m_unmatched_codes = new uint32_t[max_lines];
+            m_num_unmatched_codes = 0;
+            // Codes without a sensor are only seen when the message is parsed in full
+            m_layout_length = 0;
+        } else if (!discovery) {
+            delete[] m_unmatched_codes;
+            m_unmatched_codes = nullptr;
+        }
+    }
+
+    // Send to the secondary P1 port through a UART of its own (e.g. UART1 on the ESP8266,
+    // which only has TX), possibly at another baud rate. Sending then continues while the
+    // next message is received, from a buffer the size of the message buffer.
+    void SetSecondaryUART(UARTComponent *uart) { m_secondary_uart = uart; }
+
+    // Read every message, but publish momentary values (C.7.x, e.g. power, voltage and
+    // current) only every period_s seconds, as the time-weighted mean over the period.
+    // Other values are still published as they are received.
+    void SetAggregationPeriod(uint32_t period_s) { m_aggregation_period = period_s * 1000; }
+
+    // Number of values published per call to loop(). Values are queued as they are
+    // decoded and published a few at a time, momentary power first, then the other
+    // momentary values and cumulative values last. 0 publishes each value directly.
+    void SetPublishBudget(int values_per_loop) { m_publish_budget = std::max(0, values_per_loop); }
+
+    // Publish the number of values published per second (over 10 s). It drops when the
+    // API connection is congested and the publish rate is lowered.
+    void SetPublishRateSensor(Sensor *sensor) { m_publish_rate_sensor = sensor; }
+
+    // Publish the minimum and maximum of a momentary value over each aggregation period.
+    // The sensor for the value itself must have been added first.
+    void AddAggregateSensors(Sensor *minimum, Sensor *maximum, int a, int b, int major, int minor, int micro)
+    {
+        SensorListItem *const item{ GetItem(OBIS(a, b, major, minor, micro)) };
+        if (item == nullptr) {
+            ESP_LOGE("p1reader", "No sensor for %d-%d:%d.%d.%d to add aggregate sensors to.", a, b, major, minor, micro);
+            return;
+        }
+        item->GetAggregate().minimum_sensor = minimum;
+        item->GetAggregate().maximum_sensor = maximum;
+    }
+
+    // Track the hourly mean power (energy imported per clock hour) for tariffs that are
+    // based on the average of the num_peaks highest hours of the month. Publishes that
+    // average, and a projection of the current hour, in kW. With distinct_days, only the
+    // highest hour of each day counts. Uses the time of the message (0-0:1.0.0) and the
+    // import register (1.8.0, or 1.8.1 + 1.8.2). The peaks are saved to flash once an
+    // hour, so that they survive restarts.
+    void AddPeakSensors(Sensor *peak_average, Sensor *hour_projection, int num_peaks = 3, bool distinct_days = false)
+    {
+        m_peak_average_sensor = peak_average;
+        m_hour_projection_sensor = hour_projection;
+        m_num_peaks = std::max(1, std::min(num_peaks, max_peaks));
+        m_peaks_distinct_days = distinct_days;
+    }
+
+    // Call callback with a snapshot of the values of all sensors each time a message has
+    // been processed, for example
+    //   meter_sensor->AddOnTelegramCallback([](P1Snapshot const &snapshot) {
+    //     float const net{ snapshot.Get(P1Reader::OBIS(1, 7, 0)) - snapshot.Get(P1Reader::OBIS(2, 7, 0)) };
+    //   });
+    void AddOnTelegramCallback(std::function<void(P1Snapshot const &)> callback)
+    {
+        RequireSnapshot();
+        m_telegram_callbacks.add(std::move(callback));
+    }
+
+    // The snapshot of the last processed message. The snapshot is only kept once it is
+    // used, so the first call (if made after setup) returns an empty one.
+    P1Snapshot const &GetSnapshot() { return RequireSnapshot(); }
+
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+    // Also send the snapshot of each message as a UDP datagram to a multicast group (e.g.
+    // IPAddress(239, 255, 1, 1) and port 5001), for controllers on the local network that
+    // need the values without going through Home Assistant. See SendDatagram for the layout.
+    void SetMulticast(IPAddress group, uint16_t port)
+    {
+        m_multicast_group = group;
+        m_multicast_port = port;
+    }
+
+    // Act as a Modbus TCP energy meter (e.g. for the zero export control of PV inverters
+    // and batteries), with a SunSpec register map: the common model and model 203 (three
+    // phase meter) from holding register 40000. The registers are updated once for each
+    // message, and polls are answered from them.
+    void SetModbusServer(uint16_t port = 502) { m_modbus_port = port; }
+#endif
+
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+    // Push each snapshot to browsers as server-sent events on /p1/events of the web
+    // server: a "snapshot" event with the values as JSON, and for ASCII messages a "raw"
+    // event with the message itself.
+    void SetEventStream(bool event_stream) { m_event_stream = event_stream; }
+
+    // Serve the values, together with the reader's own counters and timing, on /metrics of
+    // the web server in the Prometheus text format. The text is made once for each message
+    // and every scrape gets a copy of it.
+    void SetMetrics(bool metrics) { m_metrics_enabled = metrics; }
+#endif
+
+    // Call callback(true) when a value rises to upper or above, and callback(false) when
+    // it falls to lower or below again. Limits are in the unit sent by the meter (e.g. kW
+    // and A). The value must stay beyond the limit for debounce_ms before the callback is
+    // called. Thresholds are checked as each value is decoded, in the same call to loop(),
+    // for example
+    //   meter_sensor->AddThreshold(P1Reader::OBIS(31, 7, 0), 16.0f, 14.0f, 0, [](bool above) {
+    //     if (above) id(heater_relay).turn_off(); else id(heater_relay).turn_on();
+    //   });
+    void AddThreshold(uint32_t obisCode, float upper, float lower, uint32_t debounce_ms, std::function<void(bool)> callback)
+    {
+        Threshold *const threshold{ new Threshold };
+        threshold->obis_code = obisCode;
+        threshold->upper = static_cast<int64_t>(upper * 1000.0f + (upper < 0 ? -0.5f : 0.5f));
+        threshold->lower = static_cast<int64_t>(lower * 1000.0f + (lower < 0 ? -0.5f : 0.5f));
+        threshold->debounce = debounce_ms;
+        threshold->callback = std::move(callback);
+        threshold->next = m_thresholds;
+        m_thresholds = threshold;
+    }
+
+    // Values calculated from each message
+    enum class derived_values {
+        NET_POWER, // 1.7.0 - 2.7.0 (kW)
+        APPARENT_POWER_L1, // 32.7.0 * 31.7.0 (kVA)
+        APPARENT_POWER_L2, // 52.7.0 * 51.7.0 (kVA)
+        APPARENT_POWER_L3, // 72.7.0 * 71.7.0 (kVA)
+        POWER_FACTOR, // From net active (1.7.0 - 2.7.0) and reactive (3.7.0 - 4.7.0) power
+        PHASE_IMBALANCE // Largest deviation of 31/51/71.7.0 from their mean (%)
+    };
+
+    // Call from the lambda in the yaml file, like AddSensor. The values the calculation
+    // needs are read also when they have no sensors of their own.
+    Sensor *AddDerivedSensor(derived_values value)
+    {
+        m_sensor_list = new SensorListItem(m_sensor_list, DerivedCode(value));
+        m_derived_items[static_cast<int>(value)] = m_sensor_list;
+        return m_sensor_list->GetSensor();
+    }
+
+    // Alternative to AddSensor when the set of sensors is known at compile time. Call once
+    // from the lambda in the yaml file, for example
+    //   return meter_sensor->AddSensors<P1Reader::OBIS(1, 8, 0), P1Reader::OBIS(1, 7, 0)>();
+    // The sensors are returned in the same order as the codes. All sensors are allocated in
+    // one block, and the lookup table is sorted at compile time and kept in flash.
+    template <uint32_t... Codes>
+    std::vector<Sensor *> AddSensors()
+    {
+        if (m_sensor_table != nullptr) {
+            ESP_LOGE("p1reader", "AddSensors can only be called once.");
+            return {};
+        }
+        StaticSensorTable<Codes...> *const table{ new StaticSensorTable<Codes...> };
+        m_sensor_table = table;
+        return table->GetSensors();
+    }
+
     P1Reader(UARTComponent *parent,
         Number *update_period_number = nullptr,
         esphome::gpio::GPIOSwitch *CTS_switch = nullptr,
@@ -45,6 +410,7 @@ public:
         , m_update_period_number{ update_period_number }
         , m_secondary_RTS{ secondary_RTS }
     {
+        m_telegram_time_item.m_text = true;
         ++s_objects_created;
     }
     
@@ -56,6 +422,29 @@ public:
             delete m_sensor_list;
             m_sensor_list = next;
         }
+        delete m_sensor_table;
+        delete m_discovered_table;
+        delete[] m_unmatched_codes;
+        delete m_histograms;
+        delete m_snapshot;
+        delete m_peak_state;
+        while (m_thresholds != nullptr) {
+            Threshold *next{ m_thresholds->next };
+            delete m_thresholds;
+            m_thresholds = next;
+        }
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+        delete m_multicast;
+        delete m_modbus;
+#endif
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+        delete m_event_source;
+        delete[] m_event_buffer;
+        delete m_metrics_handler;
+        delete[] m_metrics;
+#endif
+        delete[] m_tx_ring;
+        --s_objects_created;
     }
 
 private:
@@ -82,28 +471,159 @@ private:
     // Keeps track of the start of the data record while processing.
     char *m_start_of_data;
 
+    // Offset of the start of each line in the message buffer. Recorded while
+    // the (ASCII) message is received so that processing can jump directly
+    // to each line instead of scanning the whole telegram a second time.
+    constexpr static int max_lines{ 96 };
+    uint16_t m_line_start[max_lines];
+    int m_num_lines{ 0 };
+    int m_current_line{ 0 };
+
+    // Hash of each line in the current and the previous (completely processed) message.
+    // Lines that are identical to the previous message (cumulative registers between
+    // increments, zero values etc) do not need to be parsed or published again.
+    uint32_t m_line_hash_buffers[2][max_lines];
+    uint32_t *m_line_hash{ m_line_hash_buffers[0] };
+    uint32_t *m_previous_line_hash{ m_line_hash_buffers[1] };
+    int m_num_previous_lines{ 0 };
+    int m_num_unchanged_lines;
+
+    // Number of values (since start) with a unit that could not be converted to the unit
+    // of the sensor
+    int m_num_unit_mismatches{ 0 };
+
+    // Aggregation of momentary values (0 if not used)
+    unsigned long m_aggregation_period{ 0 };
+    unsigned long m_aggregation_start_time{ 0 };
+    bool m_publishing_aggregates{ false };
+
+    // Aggregated values are kept as mantissas with this exponent
+    constexpr static int aggregate_exponent{ -3 };
+
+    // Streaming mode (ASCII only). The message buffer only holds the line currently being
+    // received, each line is parsed as soon as it is complete and the CRC is calculated
+    // as the message passes by. Values are held back until the CRC has been verified.
+    bool m_streaming{ false };
+    // Overruns since the last valid message. A single one can be caused by a corrupted
+    // CRC marker, so streaming is only switched on after a few.
+    constexpr static int streaming_overruns{ 3 };
+    int m_consecutive_overruns{ 0 };
+
+    // Codes without a sensor in the message being processed, while discovery is pending
+    // (allocated in setup, and freed once discovery is done)
+    bool m_discovery{ false };
+    uint32_t *m_unmatched_codes{ nullptr };
+    int m_num_unmatched_codes{ 0 };
+    uint16_t m_stream_crc;
+    int m_stream_crc_done; // Bytes at the start of the buffer already included in the CRC
+    bool m_stream_line_truncated;
+    bool m_stream_crc_found;
+    // How much of a line that is too long for the buffer to keep (text messages etc)
+    constexpr static int stream_line_keep{ 128 };
+
+    // SML escape sequence in the previous (aligned) four bytes, and the number of escaped
+    // 1b1b1b1b sequences in the data
+    bool m_sml_escape;
+    int m_num_sml_escapes;
+
+
     // Keeps track of bytes sent when resending the message
     int m_bytes_resent;
 
+    // Binary and SML messages are passed on as ASCII, made from the snapshot one line at a
+    // time, with the CRC calculated as the lines are made.
+    char m_transcode_line[64];
+    int m_transcode_length;
+    int m_transcode_position;
+    int m_transcode_step;
+    uint16_t m_transcode_crc;
+
     enum class states {
         IDENTIFYING_MESSAGE,
         READING_MESSAGE,
         VERIFYING_CRC,
         PROCESSING_ASCII,
         PROCESSING_BINARY,
+        PROCESSING_SML,
+        PROCESSING_LAYOUT, // Same layout as the previous message, values are read directly
+        PUBLISHING, // Values parsed while streaming the message
         RESENDING, // To the optional secondary P1-port
         WAITING,
         ERROR_RECOVERY
     };
     enum states m_state { states::ERROR_RECOVERY };
 
+    // Counted since start, for the metrics (see SetMetrics)
+    uint32_t m_num_state_entries[static_cast<int>(states::ERROR_RECOVERY) + 1]{};
+    uint32_t m_num_crc_errors{ 0 };
+    uint32_t m_num_overruns{ 0 };
+    uint32_t m_total_published{ 0 };
+
+    // Durations in buckets with fixed upper bounds, the last bucket has no bound
+    struct Histogram {
+        constexpr static int num_buckets{ 8 };
+        uint32_t const *bounds;
+        uint32_t counts[num_buckets]{};
+        uint32_t count{ 0 };
+        uint64_t sum{ 0 };
+
+        void Add(uint32_t value)
+        {
+            int bucket{ 0 };
+            while (bucket < num_buckets - 1 && bounds[bucket] < value) ++bucket;
+            ++counts[bucket];
+            ++count;
+            sum += value;
+        }
+    };
+    constexpr static uint32_t phase_bounds_ms[Histogram::num_buckets - 1]{ 10, 25, 50, 100, 250, 500, 1000 };
+    constexpr static uint32_t latency_bounds_us[Histogram::num_buckets - 1]{ 1000, 2500, 5000, 10000, 25000, 50000, 100000 };
+    // Only kept for the metrics (allocated in setup)
+    struct Histograms {
+        Histogram reading{ phase_bounds_ms };
+        Histogram processing{ phase_bounds_ms };
+        Histogram total{ phase_bounds_ms };
+        Histogram trigger_latency{ latency_bounds_us };
+    };
+    Histograms *m_histograms{ nullptr };
+
     enum class data_formats {
         UNKNOWN,
         ASCII,
-        BINARY
+        BINARY,
+        SML // Smart Message Language, used by German (and some Nordic) meters
     };
     enum data_formats m_data_format{ data_formats::UNKNOWN };
 
+    // Layout of the last processed message: where the value for each sensor is found. Meters
+    // send the same lines in the same order every time, so as long as the length of the
+    // message and the OBIS codes at the learned positions are the same, the values can be
+    // read directly without parsing the whole message.
+    class SensorListItem;
+    struct LayoutEntry {
+        uint16_t obis_offset;
+        uint16_t value_offset;
+        uint8_t obis_length; // For ASCII, everything from the start of the line to the '('
+        uint8_t line; // ASCII only
+        SensorListItem *item;
+    };
+    constexpr static int max_layout_entries{ 64 };
+    LayoutEntry m_layout[max_layout_entries];
+    int m_layout_size{ 0 };
+    int m_layout_length{ 0 }; // Length of the message the layout was learned from, 0 if none
+    data_formats m_layout_format;
+    uint32_t m_layout_hash;
+    bool m_learning_layout{ false };
+    int m_layout_position;
+
+    // Start of the OBIS code for the binary value being processed
+    char const *m_obis_position{ nullptr };
+
+    // The time of the message (0-0:1.0.0) is always decoded, also without a sensor
+    constexpr static uint32_t telegram_time_code{ 0x00010000 }; // OBIS(0, 0, 1, 0, 0)
+    uint32_t m_telegram_time{ 0 };
+    P1Timestamp m_telegram_timestamp; // Local time
+
     void ChangeState(enum states new_state)
     {
         unsigned long const current_time{ millis() };
@@ -112,6 +632,14 @@ private:
             m_identifying_message_time = current_time;
             m_crc_position = m_message_buffer_position = 0;
             m_num_message_loops = m_num_processing_loops = 0;
+            m_num_lines = m_current_line = m_num_unchanged_lines = 0;
+            m_num_unmatched_codes = 0;
+            m_stream_crc = 0;
+            m_stream_crc_done = 0;
+            m_stream_line_truncated = false;
+            m_stream_crc_found = false;
+            m_sml_escape = false;
+            m_num_sml_escapes = 0;
             SetCTS();
             SetStatusLED();
             m_data_format = data_formats::UNKNOWN;
@@ -121,23 +649,44 @@ private:
             break;
         case states::VERIFYING_CRC:
             m_verifying_crc_time = current_time;
+            m_message_end_micros = micros();
             ClearCTS();
             break;
         case states::PROCESSING_ASCII:
         case states::PROCESSING_BINARY:
             m_processing_time = current_time;
             m_start_of_data = m_message_buffer;
+            // Learn the layout of this message while processing it
+            m_layout_length = m_layout_size = 0;
+            m_learning_layout = true;
+            break;
+        case states::PROCESSING_SML:
+            m_processing_time = current_time;
+            m_start_of_data = m_message_buffer + 8; // After the start escape sequence
+            m_layout_length = 0;
+            break;
+        case states::PROCESSING_LAYOUT:
+            m_processing_time = current_time;
+            m_layout_position = 0;
+            break;
+        case states::PUBLISHING:
+            m_processing_time = current_time;
+            ResetItemCursor();
             break;
         case states::RESENDING:
             m_resending_time = current_time;
-            if (m_secondary_RTS == nullptr || !m_secondary_RTS->state) {
+            // When streaming, the message is not kept and can not be resent
+            if (m_secondary_RTS == nullptr || !m_secondary_RTS->state || Streaming()) {
                 ChangeState(states::WAITING);
                 return;
             }
             m_bytes_resent = 0;
+            m_transcode_length = m_transcode_position = m_transcode_step = 0;
+            m_transcode_crc = 0;
             break;
         case states::WAITING:
             if (m_state != states::ERROR_RECOVERY) m_display_time_stats = true;
+            m_metrics_stale = true;
             m_waiting_time = current_time;
             ClearStatusLED();
             break;
@@ -145,16 +694,149 @@ private:
             m_error_recovery_time = current_time;
             ClearCTS();
         }
+        ++m_num_state_entries[static_cast<int>(new_state)];
         m_state = new_state;
     }
 
-    // Combine the three values defining a sensor into a single unsigned int for easier
-    // handling and comparison
-    static uint32_t OBIS(uint32_t major, uint32_t minor, uint32_t micro)
+    // Limits are mantissas with three decimals
+    struct Threshold {
+        uint32_t obis_code;
+        int64_t upper;
+        int64_t lower;
+        uint32_t debounce;
+        std::function<void(bool)> callback;
+        bool above{ false };
+        bool pending{ false }; // Beyond the limit, waiting for the debounce time
+        unsigned long pending_since;
+        Threshold *next{ nullptr }; // All thresholds
+        Threshold *next_for_item{ nullptr };
+    };
+    Threshold *m_thresholds{ nullptr };
+
+    // Time the last byte of the message was received, and the latency of the last and
+    // slowest threshold callbacks from there.
+    unsigned long m_message_end_micros{ 0 };
+    unsigned long m_last_trigger_latency{ 0 };
+    unsigned long m_max_trigger_latency{ 0 };
+
+    // Allocated when something uses it: telegram callbacks, GetSnapshot, the datagrams,
+    // event stream and metrics, and the ASCII message made for the secondary P1 port
+    P1Snapshot *m_snapshot{ nullptr };
+    int m_num_dropped_values{ 0 }; // Values that did not fit in the snapshot
+    CallbackManager<void(P1Snapshot const &)> m_telegram_callbacks;
+
+    P1Snapshot &RequireSnapshot()
     {
-        return (major & 0xfff) << 16 | (minor & 0xff) << 8 | (micro & 0xff);
+        if (m_snapshot == nullptr) m_snapshot = new P1Snapshot{};
+        return *m_snapshot;
     }
 
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+    // Datagram with the snapshot of each message (see SendDatagram)
+    constexpr static int datagram_header_size{ 12 };
+    constexpr static int datagram_value_size{ 13 };
+    IPAddress m_multicast_group;
+    uint16_t m_multicast_port{ 0 }; // 0 if not used
+    struct Multicast {
+        WiFiUDP udp;
+        uint8_t datagram[datagram_header_size + P1Snapshot::max_values * datagram_value_size];
+    };
+    Multicast *m_multicast{ nullptr }; // Allocated in setup when used
+
+    // Modbus TCP server (see SetModbusServer). The registers are kept as they are sent,
+    // big-endian, so that a response is a single copy.
+    constexpr static uint16_t modbus_base_address{ 40000 };
+    constexpr static int sunspec_common_length{ 66 };
+    constexpr static int sunspec_meter_length{ 105 };
+    constexpr static int sunspec_meter_start{ 2 + 2 + sunspec_common_length + 2 }; // Data of model 203
+    constexpr static int modbus_num_registers{ sunspec_meter_start + sunspec_meter_length + 2 };
+    constexpr static int max_modbus_clients{ 2 };
+    constexpr static int modbus_request_size{ 12 }; // MBAP header, function, address and count
+    uint16_t m_modbus_port{ 0 }; // 0 if not used
+    struct ModbusClient {
+        WiFiClient client;
+        uint8_t request[modbus_request_size];
+        int position{ 0 };
+        int discard{ 0 }; // Bytes left of a request that is longer than the buffer
+    };
+    struct Modbus {
+        WiFiServer server;
+        uint8_t registers[2 * modbus_num_registers];
+        ModbusClient clients[max_modbus_clients];
+        uint8_t response[9 + 2 * 125];
+
+        explicit Modbus(uint16_t port) : server(port) {}
+    };
+    Modbus *m_modbus{ nullptr }; // Allocated in setup when used
+#endif
+
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+    // Server-sent events (see SetEventStream). The JSON is made once for each message, for
+    // all clients.
+    constexpr static int event_buffer_size{ 2048 };
+    bool m_event_stream{ false };
+    AsyncEventSource *m_event_source{ nullptr };
+    char *m_event_buffer{ nullptr }; // Allocated in setup when used
+
+    // Metrics text (see SetMetrics), allocated in setup when used. It is sent straight
+    // from the buffer, so it is not made again while a response is being sent.
+    constexpr static int metrics_buffer_size{ 6144 };
+    bool m_metrics_enabled{ false };
+    char *m_metrics{ nullptr };
+    int m_metrics_length{ 0 };
+    int m_metrics_responses{ 0 }; // Responses being sent
+    char *m_metrics_position{ nullptr }; // End of the text while it is being made
+    bool m_metrics_full{ false }; // The text was cut off at the last line that fit
+    uint32_t m_num_metrics_truncations{ 0 };
+    class MetricsHandler : public AsyncWebHandler {
+        P1Reader *const m_reader;
+    public:
+        explicit MetricsHandler(P1Reader *reader) : m_reader(reader) {}
+        bool canHandle(AsyncWebServerRequest *request) override
+        {
+            return request->method() == HTTP_GET && request->url() == "/metrics";
+        }
+        void handleRequest(AsyncWebServerRequest *request) override
+        {
+            P1Reader *const reader{ m_reader };
+            ++reader->m_metrics_responses;
+            request->onDisconnect([reader]() { --reader->m_metrics_responses; });
+            request->send_P(200, "text/plain; version=0.0.4", reinterpret_cast<uint8_t const *>(reader->m_metrics), reader->m_metrics_length);
+        }
+    };
+    MetricsHandler *m_metrics_handler{ nullptr };
+#endif
+    bool m_metrics_stale{ false }; // A new message (or error) since the metrics were made
+
+    // Values waiting to be published, one queue per priority (see PublishPriority). An
+    // item is only queued once, so a newer value replaces one that is still waiting.
+    constexpr static int num_publish_priorities{ 3 };
+    SensorListItem *m_publish_queue_head[num_publish_priorities]{};
+    SensorListItem *m_publish_queue_tail[num_publish_priorities]{};
+    int m_publish_budget{ 4 };
+    int m_num_queued{ 0 };
+    int m_max_queued{ 0 }; // Since the cycle times were last logged
+
+    // Sending to the API blocks when the connection can not keep up (weak WiFi), so the
+    // time publish_state takes is tracked. When it is slow, the interval between publishes
+    // is doubled, and when it is fast again, the interval is shortened by a quarter. Queued
+    // values are replaced by newer ones in the meantime, and the whole queue is published
+    // once per interval, so that the latest value of each sensor is sent.
+    constexpr static unsigned long congested_publish_us{ 2000 };
+    constexpr static int weak_rssi{ -80 }; // dBm, halves the limit above
+    constexpr static unsigned long max_publish_interval{ 8000 };
+    constexpr static unsigned long min_publish_interval{ 250 };
+    unsigned long m_publish_us{ 0 }; // Mean time to publish a value, over the last check
+    unsigned long m_publish_us_sum{ 0 }; // Since the last check
+    int m_num_timed{ 0 };
+    unsigned long m_publish_interval{ 0 }; // ms between publishing queued values
+    unsigned long m_last_publish_time{ 0 };
+    bool m_emptying_queue{ false };
+    unsigned long m_last_congestion_check{ 0 };
+    Sensor *m_publish_rate_sensor{ nullptr };
+    int m_num_published{ 0 }; // Since m_rate_start_time
+    unsigned long m_rate_start_time{ 0 };
+
     class SensorListItem {
         uint32_t const m_obisCode;
         Sensor m_sensor;
@@ -168,16 +850,354 @@ private:
         Sensor *GetSensor() { return &m_sensor; }
         uint32_t GetCode() const { return m_obisCode; }
         SensorListItem *Next() const { return m_next; }
+
+        // Value held back until the CRC of the message has been verified (streaming mode)
+        P1Decimal m_pending_value;
+        bool m_has_pending_value{ false };
+
+        // Submeter values (gas, water, heat) come with the time they were captured, which
+        // only changes every 5 minutes or every hour. Values are only published when the
+        // capture time advances. Zero means that there is no capture time. Allocated when
+        // the first value with a capture time is received.
+        struct CaptureTime {
+            uint32_t time{ 0 };
+            uint32_t pending_time{ 0 };
+            P1Timestamp pending_timestamp;
+            bool queued{ false }; // To be published with the queued state
+            P1Timestamp queued_timestamp;
+#ifdef USE_TEXT_SENSOR
+            TextSensor *sensor{ nullptr };
+#endif
+        };
+        CaptureTime *m_capture{ nullptr };
+        CaptureTime &GetCaptureTime()
+        {
+            if (m_capture == nullptr) m_capture = new CaptureTime;
+            return *m_capture;
+        }
+
+        // Text (and timestamp) values
+        bool m_text{ false };
+#ifdef USE_TEXT_SENSOR
+        struct Text {
+            TextSensor *sensor;
+            uint32_t hash{ 0 }; // Of the last published text
+            std::string pending;
+        };
+        Text *m_text_state{ nullptr }; // Allocated by AddTextSensor
+#endif
+
+        // Time of the message that the last value was received in (see GetTelegramTime)
+        uint32_t m_time{ 0 };
+
+        // Hash of the unit of the last ASCII value, and the change of exponent that
+        // converts a value in that unit to the unit of the sensor.
+        uint32_t m_unit_hash{ 0 };
+        int8_t m_unit_exponent{ 0 };
+        bool m_unit_mismatch{ false };
+
+        // Aggregation of a momentary value over the current period. Each value is held
+        // until the next one is received, and weighted by how long it was held. Allocated
+        // when aggregation is used for the value.
+        struct Aggregate {
+            bool has_value{ false };
+            bool received{ false }; // A value was received in the current period
+            int64_t value; // Latest value
+            unsigned long value_time;
+            int64_t sum{ 0 }; // Sum of value * ms
+            unsigned long duration{ 0 }; // ms
+            int64_t minimum;
+            int64_t maximum;
+            Sensor *minimum_sensor{ nullptr };
+            Sensor *maximum_sensor{ nullptr };
+        };
+        Aggregate *m_aggregate{ nullptr };
+        Aggregate &GetAggregate()
+        {
+            if (m_aggregate == nullptr) m_aggregate = new Aggregate;
+            return *m_aggregate;
+        }
+
+        // Thresholds for this value (linked through Threshold::next_for_item)
+        Threshold *m_thresholds{ nullptr };
+
+        // State waiting in the publish queue
+        bool m_queued{ false };
+        float m_queued_state;
+        SensorListItem *m_queue_next{ nullptr };
+
+        // Latest value, in the unit sent by the meter (for derived values)
+        bool m_has_value{ false };
+        // Only read for other features (see RequireItem), never published
+        bool m_internal{ false };
+        P1Decimal m_value;
+
+        ~SensorListItem()
+        {
+            delete m_capture;
+#ifdef USE_TEXT_SENSOR
+            delete m_text_state;
+#endif
+            delete m_aggregate;
+        }
     };
 
     // Linked list of all sensors
     SensorListItem *m_sensor_list{ nullptr };
 
+    // Derived values are added to the sensor list with channel 15, which meters do not use
+    constexpr static int num_derived_values{ 6 };
+    SensorListItem *m_derived_items[num_derived_values]{};
+
+    // Hourly peaks. Energy is in Wh and days and hours are local time.
+    constexpr static int max_peaks{ 5 };
+    struct HourPeak {
+        uint32_t energy; // 0 if not used
+        uint8_t day;
+        uint8_t hour;
+    };
+    struct PeakState {
+        uint32_t hour; // Current hour, in hours since 1970 (UTC)
+        int64_t hour_start_register; // Import register at the start of the current hour
+        uint8_t year, month, day, hour_of_day; // Of the current hour
+        HourPeak peaks[max_peaks]; // Highest first
+    };
+    PeakState *m_peak_state{ nullptr }; // Allocated in setup when used
+    int m_num_peaks{ 0 }; // 0 if peaks are not tracked
+    bool m_peaks_distinct_days{ false };
+    Sensor *m_peak_average_sensor{ nullptr };
+    Sensor *m_hour_projection_sensor{ nullptr };
+    ESPPreferenceObject m_peak_preference;
+
+    // Stands in for the time of the message when it has no sensor
+    SensorListItem m_telegram_time_item{ nullptr, telegram_time_code };
+
+    // OBIS codes in ascending order, each with the index of the sensor it belongs to
+    struct SensorTableEntry {
+        uint32_t code;
+        uint32_t index; // 32 bits, since flash can only be read a word at a time on the ESP8266
+    };
+
+    template <int N>
+    struct SortedSensorTable {
+        SensorTableEntry entries[N];
+    };
+
+    // Insertion sort, evaluated by the compiler.
+    template <int N>
+    constexpr static SortedSensorTable<N> SortSensorTable(uint32_t const (&codes)[N])
+    {
+        SortedSensorTable<N> table{};
+        for (int i = 0; i < N; ++i) {
+            int j{ i };
+            for (; j > 0 && codes[i] < table.entries[j - 1].code; --j) table.entries[j] = table.entries[j - 1];
+            table.entries[j].code = codes[i];
+            table.entries[j].index = i;
+        }
+        return table;
+    }
+
+    // After sorting, a code that was given more than once ends up next to itself
+    template <int N>
+    constexpr static bool HasDuplicateCodes(SortedSensorTable<N> const &table)
+    {
+        for (int i = 1; i < N; ++i) {
+            if (table.entries[i].code == table.entries[i - 1].code) return true;
+        }
+        return false;
+    }
+
+    // Sensors added with AddSensors. The non-template base holds what is needed for lookup.
+    class SensorTable {
+    protected:
+        SensorTableEntry const *const m_entries;
+        SensorListItem *const m_items;
+        int const m_size;
+    public:
+        SensorTable(SensorTableEntry const *entries, SensorListItem *items, int size)
+            : m_entries(entries)
+            , m_items(items)
+            , m_size(size)
+        {}
+        virtual ~SensorTable() {}
+
+        // Binary search for the code
+        SensorListItem *Find(uint32_t obisCode) const
+        {
+            int low{ 0 }, high{ m_size };
+            while (low < high) {
+                int const middle{ (low + high) / 2 };
+                uint32_t const code{ m_entries[middle].code };
+                if (code == obisCode) return &m_items[m_entries[middle].index];
+                if (code < obisCode) low = middle + 1;
+                else high = middle;
+            }
+            return nullptr;
+        }
+
+        int Size() const { return m_size; }
+        SensorListItem *Item(int index) const { return &m_items[index]; }
+    };
+
+    template <uint32_t... Codes>
+    class StaticSensorTable : public SensorTable {
+        constexpr static int size{ sizeof...(Codes) };
+        static_assert(size > 0, "At least one OBIS code is needed");
+        constexpr static uint32_t codes[sizeof...(Codes)]{ Codes... };
+        constexpr static SortedSensorTable<sizeof...(Codes)> sorted PROGMEM{ SortSensorTable<sizeof...(Codes)>(codes) };
+        static_assert(!HasDuplicateCodes(sorted), "Each OBIS code can only be given once");
+        SensorListItem m_storage[sizeof...(Codes)]{ { nullptr, Codes }... };
+    public:
+        StaticSensorTable()
+            : SensorTable(sorted.entries, m_storage, size)
+        {}
+
+        std::vector<Sensor *> GetSensors()
+        {
+            std::vector<Sensor *> sensors;
+            for (SensorListItem &item : m_storage) sensors.push_back(item.GetSensor());
+            return sensors;
+        }
+    };
+
+    SensorTable *m_sensor_table{ nullptr };
+
+    // Sensors created by discovery, in ascending order of their codes. Each sensor needs
+    // a name and object id that stay in place for as long as the sensor exists.
+    class DiscoveredSensorTable : public SensorTable {
+    public:
+        constexpr static int name_length{ 32 };
+    private:
+        char (*const m_names)[name_length];
+        char (*const m_object_ids)[name_length];
+
+        static SensorTableEntry *MakeEntries(int size)
+        {
+            SensorTableEntry *const entries{ new SensorTableEntry[size] };
+            for (int i = 0; i < size; ++i) entries[i].index = i;
+            return entries;
+        }
+
+        static SensorListItem *MakeItems(uint32_t const *codes, int size)
+        {
+            SensorListItem *const items{ static_cast<SensorListItem *>(::operator new(sizeof(SensorListItem) * size)) };
+            for (int i = 0; i < size; ++i) new (&items[i]) SensorListItem(nullptr, codes[i]);
+            return items;
+        }
+    public:
+        // The codes must be sorted
+        DiscoveredSensorTable(uint32_t const *codes, int size)
+            : SensorTable(MakeEntries(size), MakeItems(codes, size), size)
+            , m_names(new char[size][name_length])
+            , m_object_ids(new char[size][name_length])
+        {
+            SensorTableEntry *const entries{ const_cast<SensorTableEntry *>(m_entries) };
+            for (int i = 0; i < size; ++i) entries[i].code = codes[i];
+        }
+
+        ~DiscoveredSensorTable()
+        {
+            for (int i = 0; i < m_size; ++i) m_items[i].~SensorListItem();
+            ::operator delete(m_items);
+            delete[] m_entries;
+            delete[] m_names;
+            delete[] m_object_ids;
+        }
+
+        char *Name(int index) const { return m_names[index]; }
+        char *ObjectId(int index) const { return m_object_ids[index]; }
+    };
+
+    DiscoveredSensorTable *m_discovered_table{ nullptr };
+
+    // OBIS codes known to discovery, in ascending order. Submeter codes (A = 0) are listed
+    // for channel 0 and match any channel.
+    enum class dictionary_units : uint8_t { NONE, KWH, KVARH, KW, KVAR, VOLT, AMPERE, HERTZ, CUBIC_METRE };
+    enum class dictionary_classes : uint8_t { NONE, ENERGY, POWER, VOLTAGE, CURRENT, FREQUENCY, POWER_FACTOR, GAS };
+
+    // The code is stored as A, C, D and E (B is 0), since OBIS() can not be used before
+    // the class is complete.
+    struct DictionaryEntry {
+        uint8_t a, c, d, e;
+        char name[28];
+        dictionary_units unit;
+        dictionary_classes device_class;
+        bool total_increasing;
+        int8_t accuracy_decimals;
+    };
+
+#define P1_ENERGY(c, d, e, name) { 1, c, d, e, name, dictionary_units::KWH, dictionary_classes::ENERGY, true, 3 }
+#define P1_POWER(c, d, e, name) { 1, c, d, e, name, dictionary_units::KW, dictionary_classes::POWER, false, 3 }
+#define P1_REACTIVE(c, d, e, name, unit, total) { 1, c, d, e, name, unit, dictionary_classes::NONE, total, 3 }
+    constexpr static DictionaryEntry dictionary[] PROGMEM{
+        { 0, 24, 2, 1, "Gas", dictionary_units::CUBIC_METRE, dictionary_classes::GAS, true, 3 },
+        P1_POWER(1, 7, 0, "Active power import"),
+        P1_ENERGY(1, 8, 0, "Active energy import"),
+        P1_ENERGY(1, 8, 1, "Active energy import T1"),
+        P1_ENERGY(1, 8, 2, "Active energy import T2"),
+        P1_POWER(2, 7, 0, "Active power export"),
+        P1_ENERGY(2, 8, 0, "Active energy export"),
+        P1_ENERGY(2, 8, 1, "Active energy export T1"),
+        P1_ENERGY(2, 8, 2, "Active energy export T2"),
+        P1_REACTIVE(3, 7, 0, "Reactive power import", dictionary_units::KVAR, false),
+        P1_REACTIVE(3, 8, 0, "Reactive energy import", dictionary_units::KVARH, true),
+        P1_REACTIVE(4, 7, 0, "Reactive power export", dictionary_units::KVAR, false),
+        P1_REACTIVE(4, 8, 0, "Reactive energy export", dictionary_units::KVARH, true),
+        { 1, 13, 7, 0, "Power factor", dictionary_units::NONE, dictionary_classes::POWER_FACTOR, false, 3 },
+        { 1, 14, 7, 0, "Frequency", dictionary_units::HERTZ, dictionary_classes::FREQUENCY, false, 2 },
+        P1_POWER(21, 7, 0, "L1 active power import"),
+        P1_POWER(22, 7, 0, "L1 active power export"),
+        P1_REACTIVE(23, 7, 0, "L1 reactive power import", dictionary_units::KVAR, false),
+        P1_REACTIVE(24, 7, 0, "L1 reactive power export", dictionary_units::KVAR, false),
+        { 1, 31, 7, 0, "L1 current", dictionary_units::AMPERE, dictionary_classes::CURRENT, false, 1 },
+        { 1, 32, 7, 0, "L1 voltage", dictionary_units::VOLT, dictionary_classes::VOLTAGE, false, 1 },
+        P1_POWER(41, 7, 0, "L2 active power import"),
+        P1_POWER(42, 7, 0, "L2 active power export"),
+        P1_REACTIVE(43, 7, 0, "L2 reactive power import", dictionary_units::KVAR, false),
+        P1_REACTIVE(44, 7, 0, "L2 reactive power export", dictionary_units::KVAR, false),
+        { 1, 51, 7, 0, "L2 current", dictionary_units::AMPERE, dictionary_classes::CURRENT, false, 1 },
+        { 1, 52, 7, 0, "L2 voltage", dictionary_units::VOLT, dictionary_classes::VOLTAGE, false, 1 },
+        P1_POWER(61, 7, 0, "L3 active power import"),
+        P1_POWER(62, 7, 0, "L3 active power export"),
+        P1_REACTIVE(63, 7, 0, "L3 reactive power import", dictionary_units::KVAR, false),
+        P1_REACTIVE(64, 7, 0, "L3 reactive power export", dictionary_units::KVAR, false),
+        { 1, 71, 7, 0, "L3 current", dictionary_units::AMPERE, dictionary_classes::CURRENT, false, 1 },
+        { 1, 72, 7, 0, "L3 voltage", dictionary_units::VOLT, dictionary_classes::VOLTAGE, false, 1 },
+    };
+#undef P1_ENERGY
+#undef P1_POWER
+#undef P1_REACTIVE
+    constexpr static int dictionary_size{ sizeof(dictionary) / sizeof(dictionary[0]) };
+
+    constexpr static uint32_t DictionaryCode(DictionaryEntry const &entry) { return OBIS(entry.a, 0, entry.c, entry.d, entry.e); }
+
+    constexpr static bool DictionarySorted()
+    {
+        for (int i = 1; i < dictionary_size; ++i) {
+            if (DictionaryCode(dictionary[i]) <= DictionaryCode(dictionary[i - 1])) return false;
+        }
+        return true;
+    }
+
+    // Cursor used by ResetItemCursor/NextItem
+    int m_item_index;
+    SensorListItem *m_item_cursor;
+
     esphome::gpio::GPIOSwitch *const m_CTS_switch;
     esphome::gpio::GPIOSwitch *const m_status_switch;
     Number const *const m_update_period_number{ nullptr };
     esphome::gpio::GPIOBinarySensor const * const m_secondary_RTS{ nullptr };
 
+    // Optional UART of its own for the secondary port. Messages are put in a ring buffer
+    // (allocated in setup), which is emptied at the baud rate of that UART while the next
+    // message is received. It holds a whole message, so that resending never waits for it.
+    UARTComponent *m_secondary_uart{ nullptr };
+    constexpr static int tx_ring_size{ message_buffer_size };
+    uint8_t *m_tx_ring{ nullptr };
+    int m_tx_start{ 0 }; // Next byte to send
+    int m_tx_count{ 0 }; // Bytes waiting to be sent
+    unsigned long m_tx_time{ 0 };
+
     unsigned long GetUpdatePeriod()
     {
         if (m_update_period_number == nullptr) return 0;
@@ -237,11 +1257,71 @@ public:
     {
         // In the "RTS/CTS always high mode, set CTS high once and leave it like that.
         if (CTSAlwaysHigh() && m_CTS_switch != nullptr) m_CTS_switch->turn_on();
+        SetUpDerivedValues();
+        SetUpPeaks();
+        SetUpThresholds();
+        if (m_secondary_uart != nullptr) m_tx_ring = new uint8_t[tx_ring_size];
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+        if (m_multicast_port != 0) {
+            RequireSnapshot();
+            m_multicast = new Multicast;
+        }
+        if (m_modbus_port != 0) SetUpModbus();
+#endif
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+        if (m_event_stream && web_server_base::global_web_server_base != nullptr) {
+            RequireSnapshot();
+            m_event_buffer = new char[event_buffer_size];
+            m_event_source = new AsyncEventSource("/p1/events");
+            web_server_base::global_web_server_base->add_handler(m_event_source);
+        }
+        if (m_metrics_enabled && web_server_base::global_web_server_base != nullptr) {
+            RequireSnapshot();
+            m_histograms = new Histograms;
+            m_metrics = new char[metrics_buffer_size];
+            FormatMetrics();
+            m_metrics_handler = new MetricsHandler(this);
+            web_server_base::global_web_server_base->add_handler(m_metrics_handler);
+        }
+#endif
         ChangeState(states::ERROR_RECOVERY);
     }
 
     void loop() override {
         unsigned long const loop_start_time{ millis() };
+        // Check the CRC and process the message in the same call as the last byte is
+        // received (time permitting), so that thresholds react as soon as possible.
+        enum states previous_state;
+        do {
+            previous_state = m_state;
+            RunState(loop_start_time);
+        } while (m_state != previous_state && ContinuesInSameLoop(m_state) && millis() - loop_start_time < 25);
+        if (m_num_queued != 0) PublishQueued(loop_start_time);
+        if (loop_start_time - m_last_congestion_check >= 1000) CheckCongestion(loop_start_time);
+        if (m_tx_count != 0) SendFromRing(loop_start_time);
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+        // Polls are answered from the registers, whatever state the reader is in
+        if (m_modbus != nullptr) ServeModbus();
+#endif
+    }
+
+private:
+    static bool ContinuesInSameLoop(enum states state)
+    {
+        switch (state) {
+        case states::VERIFYING_CRC:
+        case states::PROCESSING_ASCII:
+        case states::PROCESSING_BINARY:
+        case states::PROCESSING_SML:
+        case states::PROCESSING_LAYOUT:
+        case states::PUBLISHING:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void RunState(unsigned long const loop_start_time) {
         unsigned long minimum_period_ms = GetUpdatePeriod();
         switch (m_state) {
         case states::IDENTIFYING_MESSAGE:
@@ -258,9 +1338,13 @@ public:
                 if (read_byte == '/') {
                     ESP_LOGD("p1reader", "ASCII data format");
                     m_data_format = data_formats::ASCII;
+                    m_line_start[m_num_lines++] = 0;
                 } else if (read_byte == 0x7e) {
                     ESP_LOGD("p1reader", "BINARY data format");
                     m_data_format = data_formats::BINARY;
+                } else if (read_byte == 0x1b) {
+                    ESP_LOGD("p1reader", "SML data format");
+                    m_data_format = data_formats::SML;
                 } else {
                     ESP_LOGW("p1reader", "Unknown data format (0x%02X). Resetting.", read_byte);
                     ChangeState(states::ERROR_RECOVERY);
@@ -275,28 +1359,65 @@ public:
         case states::READING_MESSAGE:
             ++m_num_message_loops;
             while (available()) {
-                // While data is available, read it one byte at a time.
+                // Until the CRC marker is found, ASCII data is read in chunks and scanned
+                // a word at a time for line feeds and the '!' marker.
+                if (Streaming()) {
+                    if (!ReadStreamedChunk()) return;
+                    continue;
+                }
+                if (m_data_format == data_formats::ASCII && m_crc_position == 0) {
+                    if (!ReadASCIIChunk()) return;
+                    continue;
+                }
+
+                // Otherwise, read it one byte at a time.
                 char const read_byte{ (char)read() };
 
                 m_message_buffer[m_message_buffer_position++] = read_byte;
                 if (m_message_buffer_position == message_buffer_size) {
                     ESP_LOGW("p1reader", "Message buffer overrun. Resetting.");
+                    ++m_num_overruns;
                     ChangeState(states::ERROR_RECOVERY);
                     return;
                 }
 
                 // Find out where CRC will be positioned
-                if (m_data_format == data_formats::ASCII && read_byte == '!') {
-                    // The exclamation mark indicates that the main message is complete
-                    // and the CRC will come next.
-                    m_crc_position = m_message_buffer_position;
-                } else if (m_data_format == data_formats::BINARY && m_message_buffer_position == 3) {
+                if (m_data_format == data_formats::BINARY && m_message_buffer_position == 3) {
                     if ((0xe0 & m_message_buffer[1]) != 0xa0) {
                         ESP_LOGW("p1reader", "Unknown frame format (0x%02X). Resetting.", read_byte);
                         ChangeState(states::ERROR_RECOVERY);
                         return;
                     }
                     m_crc_position = ((0x1f & m_message_buffer[1]) << 8) + m_message_buffer[2] - 1;
+                } else if (m_data_format == data_formats::SML) {
+                    // An SML file starts with 1b1b1b1b 01010101 and ends with 1b1b1b1b 1a
+                    // followed by the number of padding bytes and the CRC. Escape sequences
+                    // are aligned to four bytes, and 1b1b1b1b in the data is sent twice.
+                    static char const start_sequence[]{ 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01 };
+                    int const position{ m_message_buffer_position };
+                    if (position == 8 && memcmp(m_message_buffer, start_sequence, 8) != 0) {
+                        ESP_LOGW("p1reader", "Unknown SML start sequence. Resetting.");
+                        ChangeState(states::ERROR_RECOVERY);
+                        return;
+                    }
+                    if (position >= 12 && position % 4 == 0) {
+                        char const *const group{ m_message_buffer + position - 4 };
+                        bool const escape{ memcmp(group, start_sequence, 4) == 0 };
+                        if (!m_sml_escape) {
+                            m_sml_escape = escape;
+                        } else if (escape) {
+                            m_sml_escape = false;
+                            ++m_num_sml_escapes;
+                        } else if (group[0] == 0x1a) {
+                            m_crc_position = position - 2;
+                            ChangeState(states::VERIFYING_CRC);
+                            return;
+                        } else {
+                            ESP_LOGW("p1reader", "Unsupported SML escape sequence (0x%02X). Resetting.", static_cast<uint8_t>(group[0]));
+                            ChangeState(states::ERROR_RECOVERY);
+                            return;
+                        }
+                    }
                 }
 
                 // If end of CRC is reached, start verifying CRC
@@ -327,20 +1448,36 @@ public:
             int crc_from_msg = -1;
             int crc = 0;
 
-            if (m_data_format == data_formats::ASCII) {
+            if (Streaming()) {
+                // The CRC has already been calculated and only the CRC line is in the buffer
+                crc_from_msg = (int) strtol(m_message_buffer, NULL, 16);
+                crc = m_stream_crc;
+            } else if (m_data_format == data_formats::ASCII) {
                 crc_from_msg = (int) strtol(m_message_buffer + m_crc_position, NULL, 16);
                 crc = crc16_ccitt_false(m_message_buffer, m_crc_position);
             } else if (m_data_format == data_formats::BINARY) {
-                crc_from_msg = (m_message_buffer[m_crc_position + 1] << 8) + m_message_buffer[m_crc_position];
+                crc_from_msg = (static_cast<uint8_t>(m_message_buffer[m_crc_position + 1]) << 8) + static_cast<uint8_t>(m_message_buffer[m_crc_position]);
                 crc = crc16_x25(&m_message_buffer[1], m_crc_position - 1);
+            } else if (m_data_format == data_formats::SML) {
+                crc_from_msg = (static_cast<uint8_t>(m_message_buffer[m_crc_position + 1]) << 8) + static_cast<uint8_t>(m_message_buffer[m_crc_position]);
+                crc = crc16_x25(m_message_buffer, m_crc_position);
             }
 
             if (crc == crc_from_msg) {
                 ESP_LOGD("p1reader", "CRC verification OK");
-                if (m_data_format == data_formats::ASCII) {
+                m_consecutive_overruns = 0;
+                if (m_data_format == data_formats::SML && m_num_sml_escapes != 0) UnescapeSML();
+                if (Streaming()) {
+                    ChangeState(states::PUBLISHING);
+                } else if (MatchesLayout()) {
+                    ESP_LOGD("p1reader", "Same layout as previous message");
+                    ChangeState(states::PROCESSING_LAYOUT);
+                } else if (m_data_format == data_formats::ASCII) {
                     ChangeState(states::PROCESSING_ASCII);
                 } else if (m_data_format == data_formats::BINARY) {
                     ChangeState(states::PROCESSING_BINARY);
+                } else if (m_data_format == data_formats::SML) {
+                    ChangeState(states::PROCESSING_SML);
                 } else {
                     ChangeState(states::ERROR_RECOVERY);
                 }
@@ -349,19 +1486,19 @@ public:
 
             // CRC verification failed
             ESP_LOGW("p1reader", "CRC mismatch, calculated %04X != %04X. Message ignored.", crc, crc_from_msg);
-            if (m_data_format == data_formats::ASCII) {
+            ++m_num_crc_errors;
+            if (Streaming()) {
+                DiscardPendingValues();
+            } else if (m_data_format == data_formats::ASCII) {
                 ESP_LOGD("p1reader", "Buffer:\n%s (%d)", m_message_buffer, m_message_buffer_position);
-            } else if (m_data_format == data_formats::BINARY) {
+            } else if (m_data_format == data_formats::BINARY || m_data_format == data_formats::SML) {
                 ESP_LOGD("p1reader", "Buffer:");
                 char hex_buffer[81];
                 hex_buffer[80] = '\0';
                 for (int i = 0; i * 40 < m_message_buffer_position; i++) {
                     int j;
                     for (j = 0; j + i * 40 < m_message_buffer_position && j < 40; j++) {
-                        sprintf(&hex_buffer[2*j], "%02X", m_message_buffer[j + i*40]);
-                    }
-                    if (j >= m_message_buffer_position) {
-                        hex_buffer[j] = '\0';
+                        sprintf(&hex_buffer[2*j], "%02X", static_cast<uint8_t>(m_message_buffer[j + i*40]));
                     }
                     ESP_LOGD("p1reader", "%s", hex_buffer);
                 }
@@ -372,33 +1509,18 @@ public:
         case states::PROCESSING_ASCII:
             ++m_num_processing_loops;
             do {
-                while (*m_start_of_data == '\n' || *m_start_of_data == '\r') ++m_start_of_data;
-                char *end_of_line{ m_start_of_data };
-                while (*end_of_line != '\n' && *end_of_line != '\r' && *end_of_line != '\0' && *end_of_line != '!') ++end_of_line;
-                char const end_of_line_char{ *end_of_line };
-                *end_of_line = '\0';
-
-                if (end_of_line != m_start_of_data) {
-                    int minor{ -1 }, major{ -1 }, micro{ -1 };
-                    double value{ -1.0 };
-                    if (sscanf(m_start_of_data, "1-0:%d.%d.%d(%lf", &major, &minor, &micro, &value) != 4) {
-                        ESP_LOGD("p1reader", "Could not parse value from line '%s'", m_start_of_data);
-                    }
-                    else {
-                        uint32_t const obisCode{ OBIS(major, minor, micro) };
-                        Sensor *S{ GetSensor(obisCode) };
-                        if (S != nullptr) S->publish_state(value);
-                        else {
-                            ESP_LOGD("p1reader", "No sensor matching: %d.%d.%d (0x%x)", major, minor, micro, obisCode);
-                        }
-                    }
-                }
-                *end_of_line = end_of_line_char;
-                if (end_of_line_char == '\0' || end_of_line_char == '!') {
+                // The last recorded line is the one starting with the '!' (CRC) marker
+                if (m_current_line >= m_num_lines - 1) {
+                    MessageProcessed();
                     ChangeState(states::RESENDING);
                     return;
                 }
-                m_start_of_data = end_of_line + 1;
+                char *const start_of_line{ m_message_buffer + m_line_start[m_current_line] };
+                char *end_of_line{ m_message_buffer + m_line_start[m_current_line + 1] - 1 };
+                ++m_current_line;
+                if (end_of_line > start_of_line && *(end_of_line - 1) == '\r') --end_of_line;
+
+                ProcessASCIILine(start_of_line, end_of_line, m_current_line - 1);
             } while (millis() - loop_start_time < 25);
             break;
         case states::PROCESSING_BINARY: {
@@ -426,50 +1548,40 @@ public:
                 case 0x02: // struct
                     m_start_of_data += 2;
                     break;
-                case 0x06: {// unsigned double long
-                    uint32_t v = (*(m_start_of_data + 1) << 24 | *(m_start_of_data + 2) << 16 | *(m_start_of_data + 3) << 8 | *(m_start_of_data + 4));
-                    float fv = v * 1.0 / 1000;
-                    Sensor *S{ GetSensor(obis_code) };
-                    if (S != nullptr) S->publish_state(fv);
-                    m_start_of_data += 1 + 4;
+                case 0x06: // unsigned double long
+                case 0x10: // unsigned long
+                case 0x12: {// signed long
+                    P1Decimal value;
+                    int const length{ DecodeBinaryValue(m_start_of_data, value) };
+                    SensorListItem *const item{ GetItemForValue(obis_code) };
+                    if (item != nullptr) {
+                        LearnLayout(m_obis_position, 6, m_start_of_data, item);
+                        PublishBinaryValue(item, value, m_start_of_data + length);
+                    }
+                    m_start_of_data += length;
                     break;
                 }
                 case 0x09: // octet
-                    if (*(m_start_of_data + 1) == 0x06) {
-                        int minor{ -1 }, major{ -1 }, micro{ -1 };
-                        major = *(m_start_of_data + 4);
-                        minor = *(m_start_of_data + 5);
-                        micro = *(m_start_of_data + 6);
-
-                        obis_code = OBIS(major, minor, micro);
-                    }
-                    m_start_of_data += 2 + (int) *(m_start_of_data + 1);
-                    break;
                 case 0x0a: // string
-                    m_start_of_data += 2 + (int) *(m_start_of_data + 1);
-                    break;
-                case 0x0c: // datetime
-                    m_start_of_data += 13;
+                case 0x0c: { // datetime
+                    // A value directly after the OBIS code may be a text value
+                    SensorListItem *const item{ m_start_of_data == m_obis_position + 6 ? GetItem(obis_code) : nullptr };
+                    if (item != nullptr && item->m_text) {
+                        LearnLayout(m_obis_position, 6, m_start_of_data, item);
+                        m_start_of_data += ProcessBinaryText(item, m_start_of_data);
+                        break;
+                    }
+                    if (type == 0x09 && *(m_start_of_data + 1) == 0x06) {
+                        uint8_t const *const obis{ reinterpret_cast<uint8_t const *>(m_start_of_data + 2) };
+                        obis_code = OBIS(obis[0], obis[1], obis[2], obis[3], obis[4]);
+                        m_obis_position = m_start_of_data + 2;
+                    }
+                    m_start_of_data += type == 0x0c ? 13 : 2 + (int) *(m_start_of_data + 1);
                     break;
+                }
                 case 0x0f: // scalar
                     m_start_of_data += 2;
                     break;
-                case 0x10: {// unsigned long
-                    uint16_t v = (*(m_start_of_data + 1) << 8 | *(m_start_of_data + 2));
-                    float fv = v * 1.0 / 10;
-                    Sensor *S{ GetSensor(obis_code) };
-                    if (S != nullptr) S->publish_state(fv);
-                    m_start_of_data += 3;
-                    break;
-                }
-                case 0x12: {// signed long
-                    int16_t v = (*(m_start_of_data + 1) << 8 | *(m_start_of_data + 2));
-                    float fv = v * 1.0 / 10;
-                    Sensor *S{ GetSensor(obis_code) };
-                    if (S != nullptr) S->publish_state(fv);
-                    m_start_of_data += 3;
-                    break;
-                }
                 case 0x16: // enum
                     m_start_of_data += 2;
                     break;
@@ -479,18 +1591,91 @@ public:
                     return;
                 }
                 if (m_start_of_data >= m_message_buffer + m_crc_position) {
+                    MessageProcessed();
+                    ChangeState(states::RESENDING);
+                    return;
+                }
+            } while (millis() - loop_start_time < 25);
+            break;
+        }
+        case states::PROCESSING_SML: {
+            ++m_num_processing_loops;
+            // Everything up to the end escape sequence (8 bytes from the end)
+            uint8_t const *const end{ reinterpret_cast<uint8_t const *>(m_message_buffer + m_crc_position - 6) };
+            do {
+                uint8_t const *const position{ reinterpret_cast<uint8_t const *>(m_start_of_data) };
+                if (position >= end) {
+                    MessageProcessed();
                     ChangeState(states::RESENDING);
                     return;
                 }
+                uint8_t const *const next{ ProcessSMLElement(position, end) };
+                if (next == nullptr) {
+                    ESP_LOGW("p1reader", "Malformed SML data at offset %d. Resetting.", (int) (m_start_of_data - m_message_buffer));
+                    ChangeState(states::ERROR_RECOVERY);
+                    return;
+                }
+                m_start_of_data = const_cast<char *>(reinterpret_cast<char const *>(next));
             } while (millis() - loop_start_time < 25);
             break;
         }
+        case states::PROCESSING_LAYOUT:
+            ++m_num_processing_loops;
+            do {
+                if (m_layout_position == m_layout_size) {
+                    MessageProcessed();
+                    ChangeState(states::RESENDING);
+                    return;
+                }
+                LayoutEntry const &entry{ m_layout[m_layout_position++] };
+                if (m_data_format == data_formats::ASCII && LineUnchanged(entry.line)) {
+                    ++m_num_unchanged_lines;
+                    if (entry.item->m_thresholds != nullptr) CheckThresholds(entry.item);
+                    continue;
+                }
+                char const *position{ m_message_buffer + entry.value_offset };
+                if (m_data_format == data_formats::ASCII) {
+                    ProcessASCIIValue(entry.item, position, entry.line);
+                } else if (entry.item->m_text) {
+                    ProcessBinaryText(entry.item, position);
+                } else {
+                    P1Decimal value;
+                    int const length{ DecodeBinaryValue(position, value) };
+                    if (length != 0) PublishBinaryValue(entry.item, value, position + length);
+                }
+            } while (millis() - loop_start_time < 25);
+            break;
+        case states::PUBLISHING:
+            ++m_num_processing_loops;
+            do {
+                SensorListItem *const item{ NextItem() };
+                if (item == nullptr) {
+                    MessageProcessed();
+                    ChangeState(states::RESENDING);
+                    return;
+                }
+                if (item->m_has_pending_value) {
+                    item->m_has_pending_value = false;
+#ifdef USE_TEXT_SENSOR
+                    if (item->m_text) {
+                        PublishText(item, item->m_text_state->pending.data(), item->m_text_state->pending.size());
+                        continue;
+                    }
+#endif
+                    PublishValue(item, item->m_pending_value);
+                }
+            } while (millis() - loop_start_time < 25);
+            break;
         case states::RESENDING:
+            // Secondary devices only understand ASCII
+            if (m_data_format != data_formats::ASCII) {
+                if (!TranscodeSlice()) ChangeState(states::WAITING);
+                break;
+            }
             if (m_bytes_resent < m_message_buffer_position) {
-                int max_bytes_to_send{ 200 };
-                do {
-                    write(m_message_buffer[m_bytes_resent++]);
-                } while (m_bytes_resent < m_message_buffer_position && max_bytes_to_send-- != 0);
+                int const max_bytes_to_send{ m_secondary_uart != nullptr ? tx_ring_size : 201 };
+                int const length{ std::min(m_message_buffer_position - m_bytes_resent, max_bytes_to_send) };
+                m_bytes_resent += WriteSecondary(m_message_buffer + m_bytes_resent, length);
             }
             else {
                 ChangeState(states::WAITING);
@@ -499,16 +1684,45 @@ public:
         case states::WAITING:
             if (m_display_time_stats) {
                 m_display_time_stats = false;
-                ESP_LOGD("p1reader", "Cycle times: Identifying = %d ms, Message = %d ms (%d loops), Processing = %d ms (%d loops), (Total = %d ms) [%d]",
+                ESP_LOGD("p1reader", "Cycle times: Identifying = %d ms, Message = %d ms (%d loops), Processing = %d ms (%d loops, %d unchanged lines), (Total = %d ms) [%d] Unit mismatches: %d, Publish queue: %d",
                     m_reading_message_time - m_identifying_message_time,
                     m_processing_time - m_reading_message_time,
                     m_num_message_loops,
                     m_waiting_time - m_processing_time,
                     m_num_processing_loops,
+                    m_num_unchanged_lines,
                     m_waiting_time - m_identifying_message_time,
-                    s_objects_created
+                    s_objects_created,
+                    m_num_unit_mismatches,
+                    m_max_queued
                 );
+                m_max_queued = m_num_queued;
                 if (s_objects_created != 1) ESP_LOGE("p1reader", "Memory leak detected!");
+                if (m_histograms != nullptr) {
+                    m_histograms->reading.Add(m_processing_time - m_reading_message_time);
+                    m_histograms->processing.Add(m_waiting_time - m_processing_time);
+                    m_histograms->total.Add(m_waiting_time - m_identifying_message_time);
+                }
+            }
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+            // Not while the metrics are being sent, they are then made after the next message
+            if (m_metrics_stale && m_metrics != nullptr && m_metrics_responses == 0) FormatMetrics();
+#endif
+            if (m_aggregation_period != 0 && !m_publishing_aggregates && m_aggregation_period <= loop_start_time - m_aggregation_start_time) {
+                m_publishing_aggregates = true;
+                m_aggregation_start_time = loop_start_time;
+                ResetItemCursor();
+            }
+            if (m_publishing_aggregates) {
+                do {
+                    SensorListItem *const item{ NextItem() };
+                    if (item == nullptr) {
+                        m_publishing_aggregates = false;
+                        break;
+                    }
+                    PublishAggregate(item, m_aggregation_start_time);
+                } while (millis() - loop_start_time < 25);
+                if (m_publishing_aggregates) break;
             }
             if (CTSAlwaysHigh() || minimum_period_ms < loop_start_time - m_identifying_message_time) {
                 ChangeState(states::IDENTIFYING_MESSAGE);
@@ -527,42 +1741,1973 @@ public:
         }
     }
 
-private:
-    uint16_t crc16_ccitt_false(char* pData, int length) {
-        int i;
-        uint16_t wCrc = 0;
+    // Read whatever ASCII data is available (up to the end of the buffer) in one go, and
+    // record the start of each line until the '!' marker is found. Returns false if the
+    // state was changed.
+    bool ReadASCIIChunk()
+    {
+        int const space_left{ message_buffer_size - m_message_buffer_position };
+        int const num_bytes{ std::min(available(), space_left) };
+        char *position{ m_message_buffer + m_message_buffer_position };
+        char *const end{ position + num_bytes };
+        read_array(reinterpret_cast<uint8_t *>(position), num_bytes);
+        m_message_buffer_position += num_bytes;
+        if (m_message_buffer_position == message_buffer_size) {
+            ++m_num_overruns;
+            if (++m_consecutive_overruns < streaming_overruns) {
+                ESP_LOGW("p1reader", "Message buffer overrun. Resetting.");
+            } else {
+                ESP_LOGW("p1reader", "Message buffer overrun %d times in a row. Switching to streaming mode and resetting.", m_consecutive_overruns);
+                if (m_secondary_RTS != nullptr) ESP_LOGW("p1reader", "Messages are not passed on to the secondary P1 port in streaming mode.");
+                m_streaming = true;
+            }
+            ChangeState(states::ERROR_RECOVERY);
+            return false;
+        }
+
+        while ((position = FindLineFeedOrCRCMarker(position, end)) != end) {
+            if (*position++ == '!') {
+                // The exclamation mark indicates that the main message is complete
+                // and the CRC will come next.
+                m_crc_position = position - m_message_buffer;
+
+                // The rest of the message may already be in this chunk. Anything after
+                // the final line feed belongs to a message we would not have had time
+                // to read anyway, so it is dropped rather than left in the buffer to be
+                // resent or logged along with this one.
+                char const *const line_feed{ static_cast<char const *>(memchr(position, '\n', end - position)) };
+                if (line_feed != nullptr) {
+                    int const message_length{ static_cast<int>(line_feed + 1 - m_message_buffer) };
+                    if (message_length < m_message_buffer_position) {
+                        ESP_LOGD("p1reader", "Dropping %d bytes after the CRC line", m_message_buffer_position - message_length);
+                        m_message_buffer_position = message_length;
+                    }
+                    ChangeState(states::VERIFYING_CRC);
+                    return false;
+                }
+                break;
+            }
+            // The line that just ended is complete, so it can be hashed
+            m_line_hash[m_num_lines - 1] = HashLine(m_message_buffer + m_line_start[m_num_lines - 1], position);
+
+            // Next line starts after the line feed
+            if (m_num_lines == max_lines) {
+                ESP_LOGW("p1reader", "Too many lines in message. Resetting.");
+                ChangeState(states::ERROR_RECOVERY);
+                return false;
+            }
+            m_line_start[m_num_lines++] = position - m_message_buffer;
+        }
+        return true;
+    }
+
+    bool Streaming() const
+    {
+        return m_streaming && m_data_format == data_formats::ASCII;
+    }
+
+    // Read whatever is available in streaming mode. Complete lines are parsed right away
+    // and the start of an incomplete line is moved to the start of the buffer. Returns
+    // false if the state was changed.
+    bool ReadStreamedChunk()
+    {
+        if (m_message_buffer_position == message_buffer_size) {
+            // The line does not fit. Keep the start of it (for parsing) and let the rest
+            // pass through the CRC calculation only.
+            m_stream_crc = crc16_ccitt_false(m_message_buffer + m_stream_crc_done, m_message_buffer_position - m_stream_crc_done, m_stream_crc);
+            m_message_buffer_position = m_stream_crc_done = stream_line_keep;
+            m_stream_line_truncated = true;
+        }
+        int const num_bytes{ std::min(available(), message_buffer_size - m_message_buffer_position) };
+        char *start_of_line{ m_message_buffer };
+        char *position{ m_message_buffer + m_message_buffer_position };
+        char *const end{ position + num_bytes };
+        read_array(reinterpret_cast<uint8_t *>(position), num_bytes);
+        m_message_buffer_position += num_bytes;
+
+        while (!m_stream_crc_found && (position = FindLineFeedOrCRCMarker(position, end)) != end) {
+            char const delimiter{ *position++ };
+            m_stream_crc = crc16_ccitt_false(start_of_line + m_stream_crc_done, position - start_of_line - m_stream_crc_done, m_stream_crc);
+            m_stream_crc_done = 0;
+            if (delimiter == '!') {
+                m_stream_crc_found = true;
+            } else {
+                char *end_of_line{ position - 1 };
+                if (m_stream_line_truncated) end_of_line = start_of_line + stream_line_keep;
+                else if (end_of_line > start_of_line && *(end_of_line - 1) == '\r') --end_of_line;
+                m_stream_line_truncated = false;
+                if (m_num_lines < max_lines) m_line_hash[m_num_lines] = HashLine(start_of_line, position);
+                ProcessASCIILine(start_of_line, end_of_line, m_num_lines++);
+            }
+            start_of_line = position;
+        }
+
+        // Keep what is left of an incomplete line (or the CRC)
+        if (start_of_line != m_message_buffer) {
+            m_message_buffer_position = end - start_of_line;
+            memmove(m_message_buffer, start_of_line, m_message_buffer_position);
+        }
+        if (m_stream_crc_found && memchr(m_message_buffer, '\n', m_message_buffer_position) != nullptr) {
+            ChangeState(states::VERIFYING_CRC);
+            return false;
+        }
+        return true;
+    }
+
+    void DiscardPendingValues()
+    {
+        ResetItemCursor();
+        for (SensorListItem *item{ NextItem() }; item != nullptr; item = NextItem()) item->m_has_pending_value = false;
+    }
+
+    // Parse one line of an ASCII message (without line ending) and publish the value,
+    // or hold it back until the CRC is verified when streaming.
+    void ProcessASCIILine(char const *start_of_line, char const *end_of_line, int line)
+    {
+        // Only lines with an OBIS code are of interest. Skip others (header, empty lines
+        // etc) without parsing them.
+        if (end_of_line == start_of_line || *start_of_line < '0' || '9' < *start_of_line) return;
+
+        char const *position{ start_of_line };
+        int const a{ ParseUInt(position) };
+        int const b{ *position == '-' ? ParseUInt(++position) : -1 };
+        int const major{ *position == ':' ? ParseUInt(++position) : -1 };
+        int const minor{ *position == '.' ? ParseUInt(++position) : -1 };
+        int const micro{ *position == '.' ? ParseUInt(++position) : -1 };
+        if (b < 0 || major < 0 || minor < 0 || micro < 0 || *position != '(') {
+            ESP_LOGD("p1reader", "Could not parse OBIS code from line '%.*s'", (int) (end_of_line - start_of_line), start_of_line);
+            return;
+        }
+        uint32_t const obisCode{ OBIS(a, b, major, minor, micro) };
+        SensorListItem *const item{ GetItemForValue(obisCode) };
+        if (item == nullptr) {
+            ESP_LOGV("p1reader", "No sensor matching: %d-%d:%d.%d.%d (0x%x)", a, b, major, minor, micro, obisCode);
+            return;
+        }
+
+        char const *const start_of_value{ position + 1 };
+        LearnLayout(start_of_line, start_of_value - start_of_line, start_of_value, item);
+        if (!ProcessASCIIValue(item, start_of_value, line)) {
+            ESP_LOGD("p1reader", "Could not parse value from line '%.*s'", (int) (end_of_line - start_of_line), start_of_line);
+        }
+    }
+
+    // Parse the value part of an ASCII line, starting after the first '('. Submeter values
+    // are preceded by their capture time: "(YYMMDDhhmmssX)(value*unit)". Returns false if
+    // there is no value.
+    bool ProcessASCIIValue(SensorListItem *item, char const *position, int line)
+    {
+        if (LineUnchanged(line)) {
+            ++m_num_unchanged_lines;
+            // The value is the same, but the debounce time of a threshold may have passed
+            if (item->m_thresholds != nullptr) CheckThresholds(item);
+            return true;
+        }
+        if (item->m_text) return ProcessASCIIText(item, position);
+        P1Timestamp capture_timestamp;
+        uint32_t capture_time{ 0 };
+        if (ParseTimestamp(position, capture_timestamp) && position[0] == ')' && position[1] == '(') {
+            position += 2;
+            capture_time = capture_timestamp.ToEpoch();
+            if (capture_time <= item->GetCaptureTime().time) {
+                ++m_num_unchanged_lines;
+                return true;
+            }
+        }
+        P1Decimal value;
+        if (!ParseDecimal(position, value)) return false;
+        if (*position == '*') value.exponent += UnitExponent(item, position + 1);
+        if (item->m_capture != nullptr) {
+            item->m_capture->pending_time = capture_time;
+            item->m_capture->pending_timestamp = capture_timestamp;
+        }
+        if (Streaming()) {
+            item->m_pending_value = value;
+            item->m_has_pending_value = true;
+        }
+        else PublishValue(item, value);
+        return true;
+    }
+
+    // Change of exponent for a value in the unit starting at unit (and ending with ')'),
+    // to get the value in the unit of the sensor.
+    int UnitExponent(SensorListItem *item, char const *unit)
+    {
+        constexpr static int max_unit_length{ 16 };
+        char const *end{ unit };
+        while (*end != ')' && end - unit < max_unit_length) ++end;
+        return UnitExponent(item, unit, end);
+    }
+
+    // The result is kept for each sensor, and only worked out again when the meter sends
+    // a different unit.
+    int UnitExponent(SensorListItem *item, char const *unit, char const *end)
+    {
+        uint32_t const hash{ HashLine(unit, end) };
+        if (hash != item->m_unit_hash) {
+            item->m_unit_hash = hash;
+            item->m_unit_exponent = 0;
+            std::string const sensor_unit{ item->GetSensor()->get_unit_of_measurement() };
+            int exponent{ 0 };
+            item->m_unit_mismatch = !sensor_unit.empty() && !ConvertUnit(unit, end, sensor_unit.c_str(), exponent);
+            if (item->m_unit_mismatch) {
+                ESP_LOGW("p1reader", "Unit %.*s of 0x%x does not match the sensor unit %s", (int) (end - unit), unit, item->GetCode(), sensor_unit.c_str());
+            }
+            item->m_unit_exponent = static_cast<int8_t>(exponent);
+        }
+        if (item->m_unit_mismatch) ++m_num_unit_mismatches;
+        return item->m_unit_exponent;
+    }
+
+    // Exponent of a unit prefix, or 0 if it is not a prefix
+    static int UnitPrefixExponent(char prefix)
+    {
+        switch (prefix) {
+        case 'm': return -3;
+        case 'k': return 3;
+        case 'M': return 6;
+        case 'G': return 9;
+        }
+        return 0;
+    }
+
+    // Compare units without the prefixes. The unit symbols are compared ignoring case (kwh
+    // and kWh), but a prefix must match exactly, since mW and MW are not the same unit.
+    // "3" matches "³" (m3 and m³).
+    static bool SameUnit(char const *unit, char const *end, char const *sensor_unit)
+    {
+        if (unit != end && *unit != *sensor_unit && (UnitPrefixExponent(*unit) != 0 || UnitPrefixExponent(*sensor_unit) != 0)) return false;
+        while (unit != end) {
+            if (*unit == '3' && sensor_unit[0] == '\xc2' && sensor_unit[1] == '\xb3') {
+                ++unit;
+                sensor_unit += 2;
+            } else if (tolower(static_cast<uint8_t>(*unit++)) != tolower(static_cast<uint8_t>(*sensor_unit++))) {
+                return false;
+            }
+        }
+        return *sensor_unit == '\0';
+    }
+
+    // Work out the change of exponent from one unit to the other, e.g. 3 from kW to W.
+    // The units are first compared as they are, so that m3 is not taken as milli-3.
+    static bool ConvertUnit(char const *unit, char const *end, char const *sensor_unit, int &exponent)
+    {
+        for (int unit_prefix = 0; unit_prefix <= 1; ++unit_prefix) {
+            int const from{ unit_prefix == 0 ? 0 : UnitPrefixExponent(*unit) };
+            if (unit_prefix != 0 && (from == 0 || end - unit < 2)) continue;
+            for (int sensor_prefix = 0; sensor_prefix <= 1; ++sensor_prefix) {
+                int const to{ sensor_prefix == 0 ? 0 : UnitPrefixExponent(*sensor_unit) };
+                if (sensor_prefix != 0 && (to == 0 || sensor_unit[1] == '\0')) continue;
+                if (SameUnit(unit + unit_prefix, end, sensor_unit + sensor_prefix)) {
+                    exponent = from - to;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Text value of an ASCII line, up to the ')'. The text is published directly from
+    // the message buffer, except when streaming, where it has to be kept until the CRC
+    // has been verified.
+    bool ProcessASCIIText(SensorListItem *item, char const *position)
+    {
+        constexpr static int max_text_length{ 96 };
+        char const *end{ position };
+        while (*end != ')' && end - position < max_text_length) ++end;
+        if (*end != ')') return false;
+        char buffer[32];
+        P1Timestamp timestamp;
+        char const *timestamp_end{ position };
+        if (ParseTimestamp(timestamp_end, timestamp) && timestamp_end == end) {
+            if (item->GetCode() == telegram_time_code) {
+                m_telegram_time = timestamp.ToEpoch();
+                m_telegram_timestamp = timestamp;
+            }
+            timestamp.Format(buffer);
+            position = buffer;
+            end = buffer + strlen(buffer);
+        }
+#ifdef USE_TEXT_SENSOR
+        if (Streaming() && item->m_text_state != nullptr) {
+            item->m_text_state->pending.assign(position, end - position);
+            item->m_has_pending_value = true;
+            return true;
+        }
+#endif
+        PublishText(item, position, end - position);
+        return true;
+    }
+
+    // Text value of a binary message: an octet string (0x09), a string (0x0a) or a
+    // date-time (0x0c, or an octet string of 12 bytes). Returns the number of bytes used.
+    int ProcessBinaryText(SensorListItem *item, char const *position)
+    {
+        uint8_t const type{ static_cast<uint8_t>(*position) };
+        int const length{ type == 0x0c ? 12 : static_cast<uint8_t>(position[1]) };
+        uint8_t const *const data{ reinterpret_cast<uint8_t const *>(position) + (type == 0x0c ? 1 : 2) };
+        uint16_t const year{ static_cast<uint16_t>(data[0] << 8 | data[1]) };
+        if (type != 0x0a && length == 12 && 2000 <= year && year < 2256) {
+            // year (2 bytes), month, day, day of week, hour, minute, second, hundredths,
+            // deviation (2 bytes) and clock status, where 0x80 is daylight saving
+            P1Timestamp const timestamp{ static_cast<uint8_t>(year - 2000), data[2], data[3], data[5], data[6], data[7], (data[11] & 0x80) != 0 };
+            if (item->GetCode() == telegram_time_code) {
+                m_telegram_time = timestamp.ToEpoch();
+                m_telegram_timestamp = timestamp;
+            }
+            char buffer[32];
+            timestamp.Format(buffer);
+            PublishText(item, buffer, strlen(buffer));
+        } else {
+            PublishText(item, reinterpret_cast<char const *>(data), length);
+        }
+        return (data - reinterpret_cast<uint8_t const *>(position)) + length;
+    }
+
+    // Attach each threshold to the item for its value
+    void SetUpThresholds()
+    {
+        for (Threshold *threshold{ m_thresholds }; threshold != nullptr; threshold = threshold->next) {
+            SensorListItem *const item{ RequireItem(threshold->obis_code) };
+            threshold->next_for_item = item->m_thresholds;
+            item->m_thresholds = threshold;
+        }
+    }
+
+    // Check the thresholds of a value and call the callbacks of those that are crossed
+    void CheckThresholds(SensorListItem *item)
+    {
+        int64_t value;
+        if (!item->m_value.ToMantissa(-3, value)) return;
+        unsigned long const now{ millis() };
+        for (Threshold *threshold{ item->m_thresholds }; threshold != nullptr; threshold = threshold->next_for_item) {
+            bool const crossed{ threshold->above ? value <= threshold->lower : value >= threshold->upper };
+            if (!crossed) {
+                threshold->pending = false;
+                continue;
+            }
+            if (!threshold->pending) {
+                threshold->pending = true;
+                threshold->pending_since = now;
+            }
+            if (now - threshold->pending_since < threshold->debounce) continue;
+            threshold->pending = false;
+            threshold->above = !threshold->above;
+            threshold->callback(threshold->above);
+            m_last_trigger_latency = micros() - m_message_end_micros;
+            m_max_trigger_latency = std::max(m_max_trigger_latency, m_last_trigger_latency);
+            if (m_histograms != nullptr) m_histograms->trigger_latency.Add(m_last_trigger_latency);
+            ESP_LOGD("p1reader", "Threshold for 0x%x %s, %lu us after the end of the message (max %lu us)", threshold->obis_code,
+                threshold->above ? "exceeded" : "cleared", m_last_trigger_latency, m_max_trigger_latency);
+        }
+    }
+
+    void SetUpPeaks()
+    {
+        if (m_num_peaks == 0) return;
+        for (uint32_t const code : { OBIS(1, 8, 0), OBIS(1, 8, 1), OBIS(1, 8, 2), OBIS(1, 7, 0) }) RequireItem(code);
+        constexpr static char const preference_name[]{ "p1reader peaks" };
+        m_peak_preference = global_preferences->make_preference<PeakState>(HashLine(preference_name, preference_name + sizeof(preference_name) - 1), true);
+        m_peak_state = new PeakState{};
+        if (!m_peak_preference.load(m_peak_state)) *m_peak_state = PeakState{};
+    }
+
+    // Import register in Wh (kWh with three decimals), or -1 if it has not been received
+    int64_t ImportRegister() const
+    {
+        int64_t total_register;
+        SensorListItem const *const total{ GetItem(OBIS(1, 8, 0)) };
+        if (total->m_has_value) return total->m_value.ToMantissa(-3, total_register) ? total_register : -1;
+        int64_t tariff_registers[2];
+        SensorListItem const *const tariff_1{ GetItem(OBIS(1, 8, 1)) };
+        SensorListItem const *const tariff_2{ GetItem(OBIS(1, 8, 2)) };
+        if (tariff_1->m_has_value && tariff_2->m_has_value && tariff_1->m_value.ToMantissa(-3, tariff_registers[0])
+            && tariff_2->m_value.ToMantissa(-3, tariff_registers[1])) {
+            return tariff_registers[0] + tariff_registers[1];
+        }
+        return -1;
+    }
+
+    // Called for each message. Closes the previous hour when a new one has started, and
+    // publishes the average of the peaks and the projection for the current hour.
+    void UpdatePeaks()
+    {
+        if (m_num_peaks == 0 || m_telegram_time == 0) return;
+        int64_t const import_register{ ImportRegister() };
+        if (import_register < 0) return;
+        PeakState &state{ *m_peak_state };
+        uint32_t const hour{ m_telegram_time / 3600 };
+        if (hour != state.hour) {
+            if (state.hour != 0 && hour == state.hour + 1) {
+                AddPeak(HourPeak{ static_cast<uint32_t>(std::max<int64_t>(0, import_register - state.hour_start_register)), state.day, state.hour_of_day });
+            } else if (state.hour != 0) {
+                ESP_LOGW("p1reader", "No messages between hour %u and %u. The energy used in between is not counted.", state.hour, hour);
+            }
+            if (state.year != m_telegram_timestamp.year || state.month != m_telegram_timestamp.month) {
+                for (HourPeak &peak : state.peaks) peak = HourPeak{};
+            }
+            state.hour = hour;
+            state.hour_start_register = import_register;
+            state.year = m_telegram_timestamp.year;
+            state.month = m_telegram_timestamp.month;
+            state.day = m_telegram_timestamp.day;
+            state.hour_of_day = m_telegram_timestamp.hour;
+            // At most once an hour, so that the flash is not worn out
+            m_peak_preference.save(&state);
+        }
+
+        if (m_peak_average_sensor != nullptr) {
+            int64_t sum{ 0 };
+            int num{ 0 };
+            for (int i = 0; i < m_num_peaks && state.peaks[i].energy != 0; ++i, ++num) sum += state.peaks[i].energy;
+            if (num != 0) m_peak_average_sensor->publish_state(P1Decimal{ sum / num, -3 }.ToFloat());
+        }
+        if (m_hour_projection_sensor != nullptr) {
+            // Energy so far, plus the current power for the rest of the hour
+            int64_t const energy{ import_register - state.hour_start_register };
+            int64_t const elapsed{ m_telegram_time % 3600 };
+            SensorListItem const *const power{ GetItem(OBIS(1, 7, 0)) };
+            int64_t projection{ energy };
+            int64_t power_mantissa;
+            if (power->m_has_value && power->m_value.ToMantissa(-3, power_mantissa)) projection += power_mantissa * (3600 - elapsed) / 3600;
+            else if (elapsed != 0) projection = energy * 3600 / elapsed;
+            m_hour_projection_sensor->publish_state(P1Decimal{ projection, -3 }.ToFloat());
+        }
+    }
+
+    // Insert the energy of an hour among the peaks, if it is high enough
+    void AddPeak(HourPeak const &peak)
+    {
+        HourPeak *const peaks{ m_peak_state->peaks };
+        // The peak to replace: the lowest one, or the one from the same day
+        int position{ m_num_peaks - 1 };
+        for (int i = 0; m_peaks_distinct_days && i < m_num_peaks && peaks[i].energy != 0; ++i) {
+            if (peaks[i].day == peak.day) {
+                position = i;
+                break;
+            }
+        }
+        if (peaks[position].energy >= peak.energy) return;
+        // Move lower peaks down to keep them in order
+        for (; position > 0 && peaks[position - 1].energy < peak.energy; --position) peaks[position] = peaks[position - 1];
+        peaks[position] = peak;
+    }
+
+    static uint32_t DerivedCode(derived_values value)
+    {
+        switch (value) {
+        case derived_values::NET_POWER: return OBIS(1, 15, 16, 7, 0);
+        case derived_values::APPARENT_POWER_L1: return OBIS(1, 15, 29, 7, 0);
+        case derived_values::APPARENT_POWER_L2: return OBIS(1, 15, 49, 7, 0);
+        case derived_values::APPARENT_POWER_L3: return OBIS(1, 15, 69, 7, 0);
+        case derived_values::POWER_FACTOR: return OBIS(1, 15, 13, 7, 0);
+        case derived_values::PHASE_IMBALANCE: return OBIS(1, 15, 91, 7, 0);
+        }
+        return 0;
+    }
+
+    // Derived values are on channel 15
+    constexpr static bool IsDerived(uint32_t code) { return ((code >> 24) & 0xf) == 15; }
+
+    // Name of a derived value for the event stream and the metrics, or nullptr if the code
+    // is not for a derived value
+    static char const *DerivedName(uint32_t code)
+    {
+        static char const *const names[num_derived_values]{ "net_power", "apparent_power_l1", "apparent_power_l2",
+            "apparent_power_l3", "power_factor", "phase_imbalance" };
+        if (!IsDerived(code)) return nullptr;
+        for (int i = 0; i < num_derived_values; ++i) {
+            if (DerivedCode(static_cast<derived_values>(i)) == code) return names[i];
+        }
+        return nullptr;
+    }
+
+    // Codes of the values that a derived value is calculated from (up to four), and the
+    // unit of the result.
+    static int DerivedInputs(derived_values value, uint32_t *inputs, char const *&unit)
+    {
+        switch (value) {
+        case derived_values::NET_POWER:
+            inputs[0] = OBIS(1, 7, 0);
+            inputs[1] = OBIS(2, 7, 0);
+            unit = "kW";
+            return 2;
+        case derived_values::APPARENT_POWER_L1:
+        case derived_values::APPARENT_POWER_L2:
+        case derived_values::APPARENT_POWER_L3: {
+            uint32_t const phase{ static_cast<uint32_t>(value) - static_cast<uint32_t>(derived_values::APPARENT_POWER_L1) };
+            inputs[0] = OBIS(32 + 20 * phase, 7, 0);
+            inputs[1] = OBIS(31 + 20 * phase, 7, 0);
+            unit = "kVA";
+            return 2;
+        }
+        case derived_values::POWER_FACTOR:
+            inputs[0] = OBIS(1, 7, 0);
+            inputs[1] = OBIS(2, 7, 0);
+            inputs[2] = OBIS(3, 7, 0);
+            inputs[3] = OBIS(4, 7, 0);
+            unit = "";
+            return 4;
+        case derived_values::PHASE_IMBALANCE:
+            inputs[0] = OBIS(31, 7, 0);
+            inputs[1] = OBIS(51, 7, 0);
+            inputs[2] = OBIS(71, 7, 0);
+            unit = "%";
+            return 3;
+        }
+        return 0;
+    }
+
+    // Make sure that the inputs of each derived value are read, and work out the unit
+    // conversion for the result. Done once all sensors have been added.
+    void SetUpDerivedValues()
+    {
+        for (int i = 0; i < num_derived_values; ++i) {
+            SensorListItem *const item{ m_derived_items[i] };
+            if (item == nullptr) continue;
+            uint32_t inputs[4];
+            char const *unit;
+            int const num_inputs{ DerivedInputs(static_cast<derived_values>(i), inputs, unit) };
+            for (int j = 0; j < num_inputs; ++j) RequireItem(inputs[j]);
+            std::string const sensor_unit{ item->GetSensor()->get_unit_of_measurement() };
+            int exponent{ 0 };
+            if (!sensor_unit.empty() && !ConvertUnit(unit, unit + strlen(unit), sensor_unit.c_str(), exponent)) {
+                ESP_LOGW("p1reader", "Derived value %d is in %s, not %s", i, unit, sensor_unit.c_str());
+            }
+            item->m_unit_exponent = static_cast<int8_t>(exponent);
+        }
+    }
+
+    // Calculate and publish the derived values from the values of the message that has just
+    // been processed. Integer arithmetic on values with three decimals.
+    void PublishDerivedValues()
+    {
+        for (int i = 0; i < num_derived_values; ++i) {
+            SensorListItem *const item{ m_derived_items[i] };
+            if (item == nullptr) continue;
+            uint32_t inputs[4];
+            char const *unit;
+            int const num_inputs{ DerivedInputs(static_cast<derived_values>(i), inputs, unit) };
+            int64_t values[4];
+            bool complete{ true };
+            for (int j = 0; j < num_inputs; ++j) {
+                SensorListItem const *const input{ GetItem(inputs[j]) };
+                complete = complete && input != nullptr && input->m_has_value && input->m_value.ToMantissa(-3, values[j]);
+            }
+            if (!complete) continue;
+
+            int64_t result;
+            switch (static_cast<derived_values>(i)) {
+            case derived_values::NET_POWER:
+                result = values[0] - values[1];
+                break;
+            case derived_values::APPARENT_POWER_L1:
+            case derived_values::APPARENT_POWER_L2:
+            case derived_values::APPARENT_POWER_L3:
+                // V * A = VA, to kVA with three decimals
+                result = values[0] * values[1] / 1000000;
+                break;
+            case derived_values::POWER_FACTOR: {
+                int64_t const active{ values[0] - values[1] };
+                int64_t const reactive{ values[2] - values[3] };
+                int64_t const apparent{ static_cast<int64_t>(SquareRoot(static_cast<uint64_t>(active * active + reactive * reactive))) };
+                if (apparent == 0) continue;
+                result = (active < 0 ? -active : active) * 1000 / apparent;
+                break;
+            }
+            case derived_values::PHASE_IMBALANCE: {
+                int64_t const mean{ (values[0] + values[1] + values[2]) / 3 };
+                int64_t deviation{ 0 };
+                for (int j = 0; j < 3; ++j) deviation = std::max(deviation, values[j] < mean ? mean - values[j] : values[j] - mean);
+                result = mean == 0 ? 0 : deviation * 100 * 1000 / mean;
+                break;
+            }
+            default:
+                continue;
+            }
+            PublishValue(item, P1Decimal{ result, static_cast<int8_t>(-3 + item->m_unit_exponent) });
+        }
+    }
+
+    // Integer square root (rounded down)
+    static uint64_t SquareRoot(uint64_t value)
+    {
+        uint64_t root{ 0 };
+        uint64_t bit{ uint64_t{ 1 } << 62 };
+        while (bit > value) bit >>= 2;
+        while (bit != 0) {
+            if (value >= root + bit) {
+                value -= root + bit;
+                root = (root >> 1) + bit;
+            } else {
+                root >>= 1;
+            }
+            bit >>= 2;
+        }
+        return root;
+    }
+
+    // C.7.x codes are momentary values
+    static bool IsMomentary(uint32_t obisCode) { return ((obisCode >> 8) & 0xff) == 7; }
+
+    // Add the time the previous value was held to the sum, and then hold the new value
+    static void AggregateValue(SensorListItem *item, int64_t value, unsigned long time)
+    {
+        SensorListItem::Aggregate &aggregate{ item->GetAggregate() };
+        if (aggregate.has_value) {
+            unsigned long const held{ time - aggregate.value_time };
+            aggregate.sum += aggregate.value * static_cast<int64_t>(held);
+            aggregate.duration += held;
+            aggregate.minimum = std::min(aggregate.minimum, value);
+            aggregate.maximum = std::max(aggregate.maximum, value);
+        } else {
+            aggregate.has_value = true;
+            aggregate.minimum = aggregate.maximum = value;
+        }
+        aggregate.value = value;
+        aggregate.value_time = time;
+        aggregate.received = true;
+    }
+
+    // Publish the mean, minimum and maximum of the period ending at end_time, and start
+    // the next period with the value that is currently held.
+    static void PublishAggregate(SensorListItem *item, unsigned long end_time)
+    {
+        if (item->m_aggregate == nullptr || !item->m_aggregate->has_value) return;
+        SensorListItem::Aggregate &aggregate{ *item->m_aggregate };
+        if (!aggregate.received) {
+            // Nothing was received in the period (e.g. the meter no longer sends the value),
+            // so the last value is neither published again nor held into the next period.
+            aggregate.has_value = false;
+            return;
+        }
+        AggregateValue(item, aggregate.value, end_time);
+        int64_t const mean{ aggregate.duration == 0 ? aggregate.value : aggregate.sum / static_cast<int64_t>(aggregate.duration) };
+        item->GetSensor()->publish_state(P1Decimal{ mean, aggregate_exponent }.ToFloat());
+        if (aggregate.minimum_sensor != nullptr) aggregate.minimum_sensor->publish_state(P1Decimal{ aggregate.minimum, aggregate_exponent }.ToFloat());
+        if (aggregate.maximum_sensor != nullptr) aggregate.maximum_sensor->publish_state(P1Decimal{ aggregate.maximum, aggregate_exponent }.ToFloat());
+        aggregate.sum = 0;
+        aggregate.duration = 0;
+        aggregate.minimum = aggregate.maximum = aggregate.value;
+        aggregate.received = false;
+    }
+
+    // Publish a text value if it has changed
+    void PublishText(SensorListItem *item, char const *text, int length)
+    {
+#ifdef USE_TEXT_SENSOR
+        SensorListItem::Text *const text_state{ item->m_text_state };
+        if (text_state == nullptr) return;
+        uint32_t const hash{ HashLine(text, text + length) };
+        if (hash == text_state->hash) return;
+        text_state->hash = hash;
+        text_state->sensor->publish_state(std::string(text, length));
+#endif
+    }
+
+    // Publish a value that belongs to a verified message
+    void PublishValue(SensorListItem *item, P1Decimal value)
+    {
+        item->m_time = m_telegram_time;
+        item->m_has_value = true;
+        item->m_value = P1Decimal{ value.mantissa, static_cast<int8_t>(value.exponent - item->m_unit_exponent) };
+        if (item->m_thresholds != nullptr) CheckThresholds(item);
+        if (item->m_internal) return;
+        if (m_aggregation_period != 0 && IsMomentary(item->GetCode())) {
+            int64_t mantissa;
+            if (value.ToMantissa(aggregate_exponent, mantissa)) AggregateValue(item, mantissa, m_identifying_message_time);
+            else ESP_LOGW("p1reader", "Value of 0x%x is too large to aggregate", item->GetCode());
+            return;
+        }
+        item->m_queued_state = value.ToFloat();
+        SensorListItem::CaptureTime *const capture{ item->m_capture };
+        if (capture != nullptr && capture->pending_time != 0) {
+            capture->time = capture->pending_time;
+            capture->pending_time = 0;
+#ifdef USE_TEXT_SENSOR
+            if (capture->sensor != nullptr) {
+                capture->queued = true;
+                capture->queued_timestamp = capture->pending_timestamp;
+            }
+#endif
+        }
+        if (m_publish_budget == 0) PublishState(item);
+        else QueueState(item);
+    }
+
+    bool Congested() const
+    {
+#ifdef USE_API
+        // Without clients, nothing is sent
+        if (api::global_api_server == nullptr || !api::global_api_server->is_connected()) return false;
+#endif
+        unsigned long limit{ congested_publish_us };
+#ifdef USE_WIFI
+        if (wifi::global_wifi_component != nullptr && wifi::global_wifi_component->wifi_rssi() < weak_rssi) limit /= 2;
+#endif
+        return m_publish_us > limit;
+    }
+
+    // Once a second, adjust the publish interval, and every 10 s publish the rate
+    void CheckCongestion(unsigned long const current_time)
+    {
+        m_last_congestion_check = current_time;
+        unsigned long const previous_interval{ m_publish_interval };
+        // Keep the last mean if nothing was published
+        if (m_num_timed != 0) m_publish_us = m_publish_us_sum / m_num_timed;
+        m_publish_us_sum = 0;
+        m_num_timed = 0;
+        if (Congested()) {
+            m_publish_interval = std::min(max_publish_interval, std::max(min_publish_interval, 2 * m_publish_interval));
+        } else {
+            m_publish_interval = m_publish_interval * 3 / 4;
+            if (m_publish_interval < min_publish_interval) m_publish_interval = 0;
+        }
+        if (m_publish_interval != previous_interval && (previous_interval == 0 || m_publish_interval == 0)) {
+            ESP_LOGW("p1reader", "Publishing %s (%lu us per value)", m_publish_interval != 0 ? "slowed down" : "back to full rate", m_publish_us);
+        }
+        if (m_publish_rate_sensor != nullptr && current_time - m_rate_start_time >= 10000) {
+            m_publish_rate_sensor->publish_state(m_num_published * 1000.0f / (current_time - m_rate_start_time));
+            m_num_published = 0;
+            m_rate_start_time = current_time;
+        }
+    }
+
+    // 0: momentary power, 1: other momentary values (voltage, current, frequency, power
+    // factor), 2: everything else (cumulative registers, submeters)
+    static int PublishPriority(uint32_t obisCode)
+    {
+        if (!IsMomentary(obisCode)) return 2;
+        int const major{ static_cast<int>((obisCode >> 16) & 0xff) };
+        // Per phase, voltage, current and power factor are 11-13 (+20, +40, +60)
+        int const quantity{ major % 20 };
+        if ((quantity >= 11 && quantity <= 14) || major > 80) return 1;
+        return 0;
+    }
+
+    void QueueState(SensorListItem *item)
+    {
+        if (item->m_queued) return;
+        item->m_queued = true;
+        item->m_queue_next = nullptr;
+        int const priority{ PublishPriority(item->GetCode()) };
+        if (m_publish_queue_head[priority] == nullptr) m_publish_queue_head[priority] = item;
+        else m_publish_queue_tail[priority]->m_queue_next = item;
+        m_publish_queue_tail[priority] = item;
+        if (++m_num_queued > m_max_queued) m_max_queued = m_num_queued;
+    }
+
+    void PublishState(SensorListItem *item)
+    {
+        unsigned long const start{ micros() };
+        ++m_num_published;
+        ++m_total_published;
+        item->GetSensor()->publish_state(item->m_queued_state);
+        m_publish_us_sum += micros() - start;
+        ++m_num_timed;
+#ifdef USE_TEXT_SENSOR
+        SensorListItem::CaptureTime *const capture{ item->m_capture };
+        if (capture != nullptr && capture->queued) {
+            capture->queued = false;
+            char buffer[32];
+            capture->queued_timestamp.Format(buffer);
+            capture->sensor->publish_state(buffer);
+        }
+#endif
+    }
+
+    // Publish up to m_publish_budget queued values, highest priority first. At least one
+    // is published in each loop, even if the time is up. When publishing has been slowed
+    // down, nothing is published until the interval has passed, and then the queue is
+    // emptied over as many loops as it takes.
+    void PublishQueued(unsigned long const loop_start_time)
+    {
+        if (m_publish_interval != 0 && !m_emptying_queue) {
+            if (loop_start_time - m_last_publish_time < m_publish_interval) return;
+            m_emptying_queue = true;
+        }
+        int budget{ m_publish_budget };
+        int priority{ 0 };
+        do {
+            while (m_publish_queue_head[priority] == nullptr) ++priority;
+            SensorListItem *const item{ m_publish_queue_head[priority] };
+            m_publish_queue_head[priority] = item->m_queue_next;
+            item->m_queued = false;
+            --m_num_queued;
+            PublishState(item);
+        } while (m_num_queued != 0 && --budget != 0 && millis() - loop_start_time < 25);
+        if (m_num_queued == 0 && m_emptying_queue) {
+            m_emptying_queue = false;
+            m_last_publish_time = loop_start_time;
+        }
+    }
+
+    // Send up to 200 bytes of the ASCII version of the message. Returns false when all of
+    // it has been sent.
+    bool TranscodeSlice()
+    {
+        int max_bytes_to_send{ 200 };
+        while (max_bytes_to_send > 0) {
+            if (m_transcode_position == m_transcode_length) {
+                if (!NextTranscodedLine()) return false;
+                m_transcode_position = 0;
+                continue;
+            }
+            int const length{ std::min(max_bytes_to_send, m_transcode_length - m_transcode_position) };
+            int const written{ WriteSecondary(m_transcode_line + m_transcode_position, length) };
+            m_transcode_position += written;
+            max_bytes_to_send -= length;
+            if (written < length) break; // The ring buffer is full
+        }
+        return true;
+    }
+
+    // Write to the secondary port, through the ring buffer if it has a UART of its own.
+    // Returns the number of bytes written, which is less than length if the ring is full.
+    int WriteSecondary(char const *data, int length)
+    {
+        if (m_secondary_uart == nullptr) {
+            write_array(reinterpret_cast<uint8_t const *>(data), length);
+            return length;
+        }
+        int const written{ std::min(length, tx_ring_size - m_tx_count) };
+        int const end{ (m_tx_start + m_tx_count) % tx_ring_size };
+        int const first{ std::min(written, tx_ring_size - end) };
+        memcpy(m_tx_ring + end, data, first);
+        memcpy(m_tx_ring, data + first, written - first);
+        m_tx_count += written;
+        return written;
+    }
+
+    // Send as much from the ring buffer as the UART has had time to send since the last
+    // call (but at least one byte, and no more than its 128 byte FIFO), so that writing
+    // does not block.
+    void SendFromRing(unsigned long const current_time)
+    {
+        unsigned long const elapsed{ std::min(current_time - m_tx_time, 100ul) };
+        m_tx_time = current_time;
+        // 10 bits per byte
+        unsigned long const sendable{ std::max(1ul, std::min(128ul, elapsed * m_secondary_uart->get_baud_rate() / 10000)) };
+        int length{ std::min(static_cast<int>(sendable), m_tx_count) };
+        while (length != 0) {
+            int const chunk{ std::min(length, tx_ring_size - m_tx_start) };
+            m_secondary_uart->write_array(m_tx_ring + m_tx_start, chunk);
+            m_tx_start = (m_tx_start + chunk) % tx_ring_size;
+            m_tx_count -= chunk;
+            length -= chunk;
+        }
+    }
+
+    // Make the next line of the ASCII message (which may be empty if there is nothing to
+    // send for a value) and add it to the CRC. Returns false after the CRC line.
+    bool NextTranscodedLine()
+    {
+        char *const line{ m_transcode_line };
+        int const step{ m_transcode_step++ };
+        P1Snapshot const &snapshot{ *m_snapshot };
+        int const num_values{ snapshot.num_values };
+        int length{ 0 };
+        if (step == 0) {
+            length = sprintf(line, "/ESP5p1mini\r\n\r\n");
+        } else if (step == 1) {
+            P1Timestamp const &time{ snapshot.timestamp };
+            if (snapshot.time != 0) {
+                length = sprintf(line, "0-0:1.0.0(%02d%02d%02d%02d%02d%02d%c)\r\n",
+                    time.year, time.month, time.day, time.hour, time.minute, time.second, time.dst ? 'S' : 'W');
+            }
+        } else if (step < 2 + num_values) {
+            length = FormatValueLine(line, snapshot.values[step - 2]);
+        } else if (step == 2 + num_values) {
+            // The CRC covers everything up to and including the '!'
+            m_transcode_crc = crc16_ccitt_false("!", 1, m_transcode_crc);
+            m_transcode_length = sprintf(line, "!%04X\r\n", m_transcode_crc);
+            return true;
+        } else {
+            return false;
+        }
+        m_transcode_crc = crc16_ccitt_false(line, length, m_transcode_crc);
+        m_transcode_length = length;
+        return true;
+    }
+
+    // A-B:C.D.E(value*unit) with the unit from the dictionary, and the integer part padded
+    // with zeros as in the Swedish format.
+    static int FormatValueLine(char *line, P1Snapshot::Value const &value)
+    {
+        uint32_t const code{ value.code };
+        int const major{ static_cast<int>(code >> 16) & 0xff };
+        int const minor{ static_cast<int>(code >> 8) & 0xff };
+        if (IsDerived(code)) return 0; // Derived values are not from the meter
+        DictionaryEntry entry;
+        char const *const unit{ FindDictionaryEntry(code, entry) ? UnitName(entry.unit) : "" };
+        int const quantity{ major % 20 };
+        int const integer_digits{ minor == 8 ? 8 : (quantity == 11 || quantity == 12 ? 3 : 4) };
+        int length{ FormatOBIS(line, code) };
+        line[length++] = '(';
+        length += FormatDecimal(line + length, value.value, integer_digits);
+        if (*unit != '\0') length += sprintf(line + length, "*%s", unit);
+        length += sprintf(line + length, ")\r\n");
+        return length;
+    }
+
+    // A-B:C.D.E
+    static int FormatOBIS(char *buffer, uint32_t code)
+    {
+        return sprintf(buffer, "%d-%d:%d.%d.%d", static_cast<int>(code >> 28), static_cast<int>(code >> 24) & 0xf,
+            static_cast<int>(code >> 16) & 0xff, static_cast<int>(code >> 8) & 0xff, static_cast<int>(code) & 0xff);
+    }
+
+    // The value with as many decimals as it was received with (at most 9)
+    static int FormatDecimal(char *buffer, P1Decimal value, int integer_digits)
+    {
+        int const decimals{ std::min(value.exponent < 0 ? -value.exponent : 0, 9) };
+        int64_t mantissa;
+        if (!value.ToMantissa(-decimals, mantissa)) {
+            // Too large to write out in full
+            int const length{ FormatDecimal(buffer, P1Decimal{ value.mantissa, 0 }, integer_digits) };
+            return length + sprintf(buffer + length, "e%d", value.exponent);
+        }
+        uint64_t const magnitude{ static_cast<uint64_t>(mantissa < 0 ? -mantissa : mantissa) };
+        uint64_t const divisor{ static_cast<uint64_t>(P1Decimal::PowerOfTen(decimals)) };
+        int length{ mantissa < 0 ? sprintf(buffer, "-") : 0 };
+        // unsigned long is 32 bits on the ESP, so the integer part is written as a uint64_t.
+        // The decimals are fewer than 10 digits and fit in 32 bits.
+        length += sprintf(buffer + length, "%0*" PRIu64, integer_digits, magnitude / divisor);
+        if (decimals > 0) length += sprintf(buffer + length, ".%0*" PRIu32, decimals, static_cast<uint32_t>(magnitude % divisor));
+        return length;
+    }
+
+    // Find the first line feed or '!' in [begin, end) (or return end if there is none).
+    // Tests a whole machine word at a time, i.e. four bytes per step on the ESP and eight
+    // on a 64 bit host, using the "has zero byte" trick on the word xor'ed with each
+    // delimiter. The byte loop at the end pins down the exact position.
+    static char *FindLineFeedOrCRCMarker(char *begin, char *end)
+    {
+        typedef uintptr_t word;
+        constexpr word ones{ ~word(0) / 0xff };
+        constexpr word highs{ ones << 7 };
+        while (end - begin >= static_cast<int>(sizeof(word))) {
+            word w;
+            memcpy(&w, begin, sizeof(word));
+            word const line_feeds{ w ^ (ones * '\n') };
+            word const markers{ w ^ (ones * '!') };
+            if ((((line_feeds - ones) & ~line_feeds) | ((markers - ones) & ~markers)) & highs) break;
+            begin += sizeof(word);
+        }
+        while (begin != end && *begin != '\n' && *begin != '!') ++begin;
+        return begin;
+    }
+
+    // Parse an unsigned decimal number and advance position past it. Returns -1 if there
+    // are no digits at position.
+    static int ParseUInt(char const *&position)
+    {
+        if (*position < '0' || '9' < *position) return -1;
+        int value{ 0 };
+        while ('0' <= *position && *position <= '9') value = value * 10 + (*position++ - '0');
+        return value;
+    }
+
+    // Parse a decimal number such as "0001.234" or "-12.5" into mantissa and exponent,
+    // without going through floating point. Advances position past the number.
+    static bool ParseDecimal(char const *&position, P1Decimal &value)
+    {
+        bool const negative{ *position == '-' };
+        if (negative) ++position;
+        int64_t mantissa{ 0 };
+        int exponent{ 0 };
+        int num_digits{ 0 };
+        bool decimals{ false };
+        for (;; ++position) {
+            if ('0' <= *position && *position <= '9') {
+                // Ignore digits beyond what fits in the mantissa (not expected from a meter)
+                if (num_digits++ < 18) {
+                    mantissa = mantissa * 10 + (*position - '0');
+                    if (decimals) --exponent;
+                } else if (!decimals) ++exponent;
+            } else if (*position == '.' && !decimals) {
+                decimals = true;
+            } else break;
+        }
+        if (num_digits == 0) return false;
+        value.mantissa = negative ? -mantissa : mantissa;
+        value.exponent = static_cast<int8_t>(exponent);
+        return true;
+    }
+
+    // Parse a time stamp such as "231016120000S" and advance position past it. Position is
+    // left unchanged if it is not a time stamp.
+    static bool ParseTimestamp(char const *&position, P1Timestamp &timestamp)
+    {
+        uint8_t fields[6];
+        for (int i = 0; i < 12; ++i) {
+            if (position[i] < '0' || '9' < position[i]) return false;
+        }
+        if (position[12] != 'W' && position[12] != 'S') return false;
+        for (int i = 0; i < 6; ++i) fields[i] = (position[2 * i] - '0') * 10 + (position[2 * i + 1] - '0');
+        timestamp = P1Timestamp{ fields[0], fields[1], fields[2], fields[3], fields[4], fields[5], position[12] == 'S' };
+        position += 13;
+        return true;
+    }
+
+    // Publish a decoded binary value in the unit of its sensor. When the value is followed
+    // by its scaler and unit (a structure of an integer and an enum), those are used.
+    // Otherwise the value is taken to be in the unit of the dictionary entry for its code.
+    void PublishBinaryValue(SensorListItem *item, P1Decimal value, char const *position)
+    {
+        uint8_t const *const scaler_unit{ reinterpret_cast<uint8_t const *>(position) };
+        char const *unit{ nullptr };
+        if (position + 6 <= m_message_buffer + m_crc_position && scaler_unit[0] == 0x02 && scaler_unit[1] == 0x02 && scaler_unit[2] == 0x0f && scaler_unit[4] == 0x16) {
+            int exponent{ static_cast<int8_t>(scaler_unit[3]) };
+            unit = DLMSUnitName(scaler_unit[5], exponent);
+            value.exponent = static_cast<int8_t>(exponent);
+        } else {
+            DictionaryEntry entry;
+            if (FindDictionaryEntry(item->GetCode(), entry)) unit = UnitName(entry.unit);
+        }
+        if (unit != nullptr && *unit != '\0') value.exponent += UnitExponent(item, unit, unit + strlen(unit));
+        PublishValue(item, value);
+    }
+
+    // Name of a DLMS unit (also used by SML), changing the exponent so that power and
+    // energy are in kW, kWh etc, as in the ASCII format. Returns nullptr for other units.
+    static char const *DLMSUnitName(int unit, int &exponent)
+    {
+        switch (unit) {
+        case 27: exponent -= 3; return "kW";
+        case 28: exponent -= 3; return "kVA";
+        case 29: exponent -= 3; return "kvar";
+        case 30: exponent -= 3; return "kWh";
+        case 31: exponent -= 3; return "kVAh";
+        case 32: exponent -= 3; return "kvarh";
+        case 33: return "A";
+        case 35: return "V";
+        case 44: return "Hz";
+        }
+        return nullptr;
+    }
+
+    // Remove the second 1b1b1b1b of each escaped pair in an SML file (after the CRC has been
+    // verified, since it covers the escaped data) and move the end sequence after the data.
+    void UnescapeSML()
+    {
+        char *const end_sequence{ m_message_buffer + m_crc_position - 6 };
+        char *to{ m_message_buffer + 8 };
+        for (char const *from{ to }; from < end_sequence; from += 4) {
+            memmove(to, from, 4);
+            to += 4;
+            if (memcmp(from, "\x1b\x1b\x1b\x1b", 4) == 0) from += 4;
+        }
+        int const removed{ static_cast<int>(end_sequence - to) };
+        memmove(to, end_sequence, m_message_buffer + m_message_buffer_position - end_sequence);
+        m_crc_position -= removed;
+        m_message_buffer_position -= removed;
+        ESP_LOGD("p1reader", "Removed %d SML escape sequences", m_num_sml_escapes);
+    }
+
+    // Decode a numeric binary value starting with its type byte. Returns the number of bytes
+    // used (including the type), or 0 if the type is not a supported number.
+    static int DecodeBinaryValue(char const *position, P1Decimal &value)
+    {
+        switch (static_cast<uint8_t>(*position)) {
+        case 0x06: // unsigned double long
+            value = P1Decimal{ static_cast<int64_t>(ReadBigEndian(position + 1, 4)), -3 };
+            return 1 + 4;
+        case 0x10: // unsigned long
+            value = P1Decimal{ static_cast<uint16_t>(ReadBigEndian(position + 1, 2)), -1 };
+            return 1 + 2;
+        case 0x12: // signed long
+            value = P1Decimal{ static_cast<int16_t>(ReadBigEndian(position + 1, 2)), -1 };
+            return 1 + 2;
+        }
+        return 0;
+    }
+
+    // Record where the value for a sensor was found while processing a message.
+    void LearnLayout(char const *obis, int obis_length, char const *value, SensorListItem *item)
+    {
+        if (!m_learning_layout) return;
+        if (m_layout_size == max_layout_entries) {
+            m_learning_layout = false;
+            return;
+        }
+        m_layout[m_layout_size++] = LayoutEntry{
+            static_cast<uint16_t>(obis - m_message_buffer),
+            static_cast<uint16_t>(value - m_message_buffer),
+            static_cast<uint8_t>(obis_length),
+            static_cast<uint8_t>(m_current_line - 1),
+            item
+        };
+    }
+
+    // Collect the latest value of each sensor (not the internal items) into the snapshot,
+    // and pass it on. The values were updated while the message was processed, so the
+    // snapshot is consistent.
+    void CommitSnapshot()
+    {
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+        if (m_modbus != nullptr) UpdateModbusRegisters();
+#endif
+        // Binary and SML messages are passed on to the secondary P1 port as ASCII, made from
+        // the snapshot
+        if (m_secondary_RTS != nullptr && m_data_format != data_formats::ASCII) RequireSnapshot();
+        if (m_snapshot == nullptr) return;
+        P1Snapshot &snapshot{ *m_snapshot };
+        ++snapshot.sequence;
+        snapshot.time = m_telegram_time;
+        snapshot.timestamp = m_telegram_timestamp;
+        snapshot.num_values = 0;
+        int num_dropped{ 0 };
+        ResetItemCursor();
+        for (SensorListItem *item{ NextItem() }; item != nullptr; item = NextItem()) {
+            if (!item->m_has_value || item->m_internal) continue;
+            if (snapshot.num_values < P1Snapshot::max_values) snapshot.values[snapshot.num_values++] = P1Snapshot::Value{ item->GetCode(), item->m_value };
+            else ++num_dropped;
+        }
+        if (num_dropped != m_num_dropped_values) {
+            m_num_dropped_values = num_dropped;
+            if (num_dropped != 0) ESP_LOGW("p1reader", "%d values left out of the snapshot (room for %d)", num_dropped, P1Snapshot::max_values);
+        }
+        m_telegram_callbacks.call(snapshot);
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+        if (m_multicast != nullptr) SendDatagram(snapshot);
+#endif
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+        if (m_event_source != nullptr && m_event_source->count() != 0) SendEvents(snapshot);
+#endif
+    }
+
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+    static uint8_t *PutBigEndian(uint8_t *position, uint64_t value, int length)
+    {
+        for (int i = length - 1; i >= 0; --i) {
+            position[i] = static_cast<uint8_t>(value);
+            value >>= 8;
+        }
+        return position + length;
+    }
+
+    // Datagram layout (all numbers big-endian):
+    //    0  'P', '1'
+    //    2  Version (1)
+    //    3  Number of values, n
+    //    4  Sequence number (uint32), increases by one for each message
+    //    8  Time of the message in seconds since 1970 UTC (uint32), 0 if it is not sent
+    //   12  n times 13 bytes: OBIS code (uint32, see OBIS), mantissa (int64) and
+    //       exponent (int8). The value is mantissa * 10^exponent in the unit sent by the
+    //       meter. Derived values are left out.
+    void SendDatagram(P1Snapshot const &snapshot)
+    {
+        uint8_t *const datagram{ m_multicast->datagram };
+        uint8_t *position{ datagram };
+        *position++ = 'P';
+        *position++ = '1';
+        *position++ = 1;
+        uint8_t &num_values{ *position++ };
+        num_values = 0;
+        position = PutBigEndian(position, snapshot.sequence, 4);
+        position = PutBigEndian(position, snapshot.time, 4);
+        for (int i = 0; i < snapshot.num_values; ++i) {
+            if (IsDerived(snapshot.values[i].code)) continue;
+            ++num_values;
+            position = PutBigEndian(position, snapshot.values[i].code, 4);
+            position = PutBigEndian(position, static_cast<uint64_t>(snapshot.values[i].value.mantissa), 8);
+            *position++ = static_cast<uint8_t>(snapshot.values[i].value.exponent);
+        }
+        WiFiUDP &udp{ m_multicast->udp };
+        if (udp.beginPacket(m_multicast_group, m_multicast_port) == 0) return;
+        udp.write(datagram, position - datagram);
+        if (udp.endPacket() == 0) ESP_LOGD("p1reader", "Could not send datagram");
+    }
+
+    void PutRegister(int index, uint16_t value)
+    {
+        m_modbus->registers[2 * index] = static_cast<uint8_t>(value >> 8);
+        m_modbus->registers[2 * index + 1] = static_cast<uint8_t>(value);
+    }
+
+    // SunSpec int16, with 0x8000 for values that are not available
+    void PutInt16(int index, bool valid, int64_t value)
+    {
+        if (!valid || value < -32767 || value > 32767) value = -32768;
+        PutRegister(index, static_cast<uint16_t>(value));
+    }
+
+    // SunSpec acc32, with 0 for values that are not available
+    void PutAcc32(int index, bool valid, int64_t value)
+    {
+        if (!valid || value < 0) value = 0;
+        PutRegister(index, static_cast<uint16_t>(value >> 16));
+        PutRegister(index + 1, static_cast<uint16_t>(value));
+    }
+
+    void PutString(int index, int length, char const *text)
+    {
+        for (int i = 0; i < length; ++i) {
+            char const first{ *text };
+            if (*text != '\0') ++text;
+            char const second{ *text };
+            if (*text != '\0') ++text;
+            PutRegister(index + i, static_cast<uint16_t>((static_cast<uint8_t>(first) << 8) | static_cast<uint8_t>(second)));
+        }
+    }
+
+    // Make sure that the values of the meter model are read (as for the derived values),
+    // start the server, and fill in the registers that do not change.
+    void SetUpModbus()
+    {
+        constexpr static uint32_t inputs[]{ OBIS(1, 7, 0), OBIS(2, 7, 0), OBIS(3, 7, 0), OBIS(4, 7, 0),
+            OBIS(21, 7, 0), OBIS(22, 7, 0), OBIS(41, 7, 0), OBIS(42, 7, 0), OBIS(61, 7, 0), OBIS(62, 7, 0),
+            OBIS(23, 7, 0), OBIS(24, 7, 0), OBIS(43, 7, 0), OBIS(44, 7, 0), OBIS(63, 7, 0), OBIS(64, 7, 0),
+            OBIS(31, 7, 0), OBIS(51, 7, 0), OBIS(71, 7, 0), OBIS(32, 7, 0), OBIS(52, 7, 0), OBIS(72, 7, 0),
+            OBIS(14, 7, 0), OBIS(1, 8, 0), OBIS(2, 8, 0) };
+        for (uint32_t const input : inputs) RequireItem(input);
+        m_modbus = new Modbus(m_modbus_port);
+        m_modbus->server.begin();
+
+        PutRegister(0, 0x5375); // "SunS"
+        PutRegister(1, 0x6e53);
+        PutRegister(2, 1); // Common model
+        PutRegister(3, sunspec_common_length);
+        PutString(4, 16, "p1mini");
+        PutString(20, 16, "P1 meter");
+        PutString(36, 8, "");
+        PutString(44, 8, "1");
+        PutString(52, 16, "");
+        PutRegister(68, 1); // Device address
+        PutRegister(69, 0x8000);
+        PutRegister(70, 203); // Three phase meter
+        PutRegister(71, sunspec_meter_length);
+        // Not available is 0 for energy (acc32, 36-101 apart from the scale factors) and the
+        // events, and 0x8000 for everything else
+        for (int i = 0; i < sunspec_meter_length; ++i) {
+            bool const zero{ (i >= 36 && i < 102 && i != 52 && i != 69) || i >= 103 };
+            PutRegister(sunspec_meter_start + i, zero ? 0 : 0x8000);
+        }
+        PutRegister(sunspec_meter_start + sunspec_meter_length, 0xffff); // End
+        PutRegister(sunspec_meter_start + sunspec_meter_length + 1, 0);
+        UpdateModbusRegisters();
+    }
+
+    // The latest value for a code (also of internal items), or nullptr if there is none
+    P1Decimal const *LatestValue(uint32_t obisCode) const
+    {
+        SensorListItem const *const item{ GetItem(obisCode) };
+        return item != nullptr && item->m_has_value ? &item->m_value : nullptr;
+    }
+
+    // The value of import_code minus export_code (if not 0) as a mantissa with the exponent.
+    // Returns false if a value is missing or does not fit.
+    bool NetMantissa(uint32_t import_code, uint32_t export_code, int exponent, int64_t &mantissa) const
+    {
+        P1Decimal const *const import_value{ LatestValue(import_code) };
+        if (import_value == nullptr || !import_value->ToMantissa(exponent, mantissa)) return false;
+        if (export_code == 0) return true;
+        P1Decimal const *const export_value{ LatestValue(export_code) };
+        int64_t export_mantissa;
+        if (export_value == nullptr || !export_value->ToMantissa(exponent, export_mantissa)) return false;
+        mantissa -= export_mantissa;
+        return true;
+    }
+
+    // A quantity of model 203 in four registers, the total and the three phases. Codes are
+    // import/export pairs for the total and each phase. Without a code for the total, it is
+    // the sum (or the mean) of the phases. The scale factor (at sf_index) starts at
+    // scale_factor and is raised until all four values fit. The SunSpec unit is
+    // 10^unit_exponent of the unit sent by the meter (-3 for W from kW).
+    void PutSunSpecPhases(int index, int sf_index, uint32_t const (&codes)[8], int scale_factor, int unit_exponent, bool mean)
+    {
+        constexpr static int max_scale_factor{ 10 };
+        int64_t values[4];
+        bool valid[4];
+        for (;; ++scale_factor) {
+            GetSunSpecPhases(codes, scale_factor + unit_exponent, mean, values, valid);
+            bool fits{ true };
+            for (int i = 0; i < 4; ++i) fits = fits && (!valid[i] || (-32767 <= values[i] && values[i] <= 32767));
+            if (fits || scale_factor == max_scale_factor) break;
+        }
+        for (int i = 0; i < 4; ++i) PutInt16(index + i, valid[i], values[i]);
+        PutRegister(sf_index, static_cast<uint16_t>(scale_factor));
+    }
+
+    void GetSunSpecPhases(uint32_t const (&codes)[8], int exponent, bool mean, int64_t (&values)[4], bool (&valid)[4]) const
+    {
+        int64_t sum{ 0 };
+        bool all_phases{ true };
+        for (int phase = 1; phase <= 3; ++phase) {
+            values[phase] = 0;
+            valid[phase] = NetMantissa(codes[2 * phase], codes[2 * phase + 1], exponent, values[phase]);
+            all_phases = all_phases && valid[phase];
+            if (valid[phase]) sum += values[phase];
+        }
+        if (codes[0] == 0) {
+            values[0] = mean ? sum / 3 : sum;
+            valid[0] = all_phases;
+            return;
+        }
+        values[0] = 0;
+        valid[0] = NetMantissa(codes[0], codes[1], exponent, values[0]);
+    }
+
+    // Model 203 in 0.01 A, 0.1 V, 0.01 Hz, W, var and Wh. The scale factors of current,
+    // voltage and power are raised for values that do not fit in an int16. Positive power is
+    // import. Apparent power, power factor, the voltages between phases and the
+    // energy per phase are not sent by the meters and marked as not available.
+    void UpdateModbusRegisters()
+    {
+        int const base{ sunspec_meter_start };
+        constexpr static uint32_t currents[]{ 0, 0, OBIS(31, 7, 0), 0, OBIS(51, 7, 0), 0, OBIS(71, 7, 0), 0 };
+        PutSunSpecPhases(base + 0, base + 4, currents, -2, 0, false);
+        constexpr static uint32_t voltages[]{ 0, 0, OBIS(32, 7, 0), 0, OBIS(52, 7, 0), 0, OBIS(72, 7, 0), 0 };
+        PutSunSpecPhases(base + 5, base + 13, voltages, -1, 0, true);
+        int64_t frequency{ 0 };
+        bool const has_frequency{ NetMantissa(OBIS(14, 7, 0), 0, -2, frequency) };
+        PutInt16(base + 14, has_frequency, frequency);
+        PutRegister(base + 15, static_cast<uint16_t>(-2));
+        // W and var from kW and kvar
+        constexpr static uint32_t power[]{ OBIS(1, 7, 0), OBIS(2, 7, 0), OBIS(21, 7, 0), OBIS(22, 7, 0),
+            OBIS(41, 7, 0), OBIS(42, 7, 0), OBIS(61, 7, 0), OBIS(62, 7, 0) };
+        PutSunSpecPhases(base + 16, base + 20, power, 0, -3, false);
+        constexpr static uint32_t reactive_power[]{ OBIS(3, 7, 0), OBIS(4, 7, 0), OBIS(23, 7, 0), OBIS(24, 7, 0),
+            OBIS(43, 7, 0), OBIS(44, 7, 0), OBIS(63, 7, 0), OBIS(64, 7, 0) };
+        PutSunSpecPhases(base + 26, base + 30, reactive_power, 0, -3, false);
+        // kWh with exponent -3 is Wh
+        int64_t exported{ 0 }, imported{ 0 };
+        bool const has_exported{ NetMantissa(OBIS(2, 8, 0), 0, -3, exported) };
+        bool const has_imported{ NetMantissa(OBIS(1, 8, 0), 0, -3, imported) };
+        PutAcc32(base + 36, has_exported, exported);
+        PutAcc32(base + 44, has_imported, imported);
+        PutRegister(base + 52, 0);
+    }
+
+#endif
+
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+    // {"sequence":12,"time":1697450400,"values":{"1-0:1.8.0":6678.394,"1-0:1.7.0":1.726},
+    // "derived":{"net_power":1.726}} with the values in kW, kWh, kvar, V and A. Values that
+    // do not fit are left out.
+    void SendEvents(P1Snapshot const &snapshot)
+    {
+        constexpr static int max_value_length{ 48 };
+        char *position{ m_event_buffer };
+        char const *const end{ m_event_buffer + event_buffer_size - 16 };
+        position += sprintf(position, "{\"sequence\":%u,\"time\":%u,\"values\":{",
+            static_cast<unsigned>(snapshot.sequence), static_cast<unsigned>(snapshot.time));
+        char const *separator{ "" };
+        for (int i = 0; i < snapshot.num_values && end - position > max_value_length; ++i) {
+            if (IsDerived(snapshot.values[i].code)) continue;
+            position += sprintf(position, "%s\"", separator);
+            position += FormatOBIS(position, snapshot.values[i].code);
+            position += sprintf(position, "\":");
+            position += FormatDecimal(position, snapshot.values[i].value, 1);
+            separator = ",";
+        }
+        position += sprintf(position, "},\"derived\":{");
+        separator = "";
+        for (int i = 0; i < snapshot.num_values && end - position > max_value_length; ++i) {
+            char const *const name{ DerivedName(snapshot.values[i].code) };
+            if (name == nullptr) continue;
+            position += sprintf(position, "%s\"%s\":", separator, name);
+            position += FormatDecimal(position, snapshot.values[i].value, 1);
+            separator = ",";
+        }
+        strcpy(position, "}}");
+        m_event_source->send(m_event_buffer, "snapshot", snapshot.sequence);
+        if (m_data_format == data_formats::ASCII && !Streaming()) {
+            // The message is still in the buffer, as it has not been resent yet
+            m_message_buffer[m_message_buffer_position] = '\0';
+            m_event_source->send(m_message_buffer, "raw", snapshot.sequence);
+        }
+    }
+#endif
+
+#if defined(USE_ARDUINO) && defined(USE_WEBSERVER)
+    // The reader's counters and histograms first, then one p1_value line per value of the
+    // last message and one p1_derived_value line per derived value, for as long as there is
+    // room. Durations are in seconds.
+    void FormatMetrics()
+    {
+        static char const *const state_names[]{ "identifying_message", "reading_message", "verifying_crc",
+            "processing_ascii", "processing_binary", "processing_sml", "processing_layout", "publishing",
+            "resending", "waiting", "error_recovery" };
+        static_assert(sizeof(state_names) / sizeof(state_names[0]) == sizeof(m_num_state_entries) / sizeof(m_num_state_entries[0]),
+            "One name per state");
+        m_metrics_stale = false;
+        m_metrics_position = m_metrics;
+        m_metrics_full = false;
+        AppendMetrics("# TYPE p1reader_state_entries_total counter\n");
+        for (int i = 0; i < static_cast<int>(sizeof(state_names) / sizeof(state_names[0])); ++i) {
+            AppendMetrics("p1reader_state_entries_total{state=\"%s\"} %u\n", state_names[i],
+                static_cast<unsigned>(m_num_state_entries[i]));
+        }
+        AppendMetrics(
+            "# TYPE p1reader_crc_errors_total counter\np1reader_crc_errors_total %u\n"
+            "# TYPE p1reader_buffer_overruns_total counter\np1reader_buffer_overruns_total %u\n"
+            "# TYPE p1reader_unit_mismatches_total counter\np1reader_unit_mismatches_total %d\n"
+            "# TYPE p1reader_published_total counter\np1reader_published_total %u\n"
+            "# TYPE p1reader_publish_queue gauge\np1reader_publish_queue %d\n"
+            "# TYPE p1reader_publish_interval_seconds gauge\np1reader_publish_interval_seconds %lu.%03lu\n"
+            "# TYPE p1reader_metrics_truncations_total counter\np1reader_metrics_truncations_total %u\n",
+            static_cast<unsigned>(m_num_crc_errors), static_cast<unsigned>(m_num_overruns), m_num_unit_mismatches,
+            static_cast<unsigned>(m_total_published), m_num_queued, m_publish_interval / 1000, m_publish_interval % 1000,
+            static_cast<unsigned>(m_num_metrics_truncations));
+        AppendMetrics("# TYPE p1reader_phase_duration_seconds histogram\n");
+        AppendHistogram("p1reader_phase_duration_seconds", "phase=\"reading\"", m_histograms->reading, -3);
+        AppendHistogram("p1reader_phase_duration_seconds", "phase=\"processing\"", m_histograms->processing, -3);
+        AppendHistogram("p1reader_phase_duration_seconds", "phase=\"total\"", m_histograms->total, -3);
+        AppendMetrics("# TYPE p1reader_threshold_latency_seconds histogram\n");
+        AppendHistogram("p1reader_threshold_latency_seconds", "", m_histograms->trigger_latency, -6);
+        AppendMetrics("# TYPE p1_value gauge\n");
+        P1Snapshot const &snapshot{ *m_snapshot };
+        char code[24];
+        char number[48];
+        for (int i = 0; i < snapshot.num_values && !m_metrics_full; ++i) {
+            if (IsDerived(snapshot.values[i].code)) continue;
+            FormatOBIS(code, snapshot.values[i].code);
+            FormatDecimal(number, snapshot.values[i].value, 1);
+            AppendMetrics("p1_value{obis=\"%s\"} %s\n", code, number);
+        }
+        AppendMetrics("# TYPE p1_derived_value gauge\n");
+        for (int i = 0; i < snapshot.num_values && !m_metrics_full; ++i) {
+            char const *const name{ DerivedName(snapshot.values[i].code) };
+            if (name == nullptr) continue;
+            FormatDecimal(number, snapshot.values[i].value, 1);
+            AppendMetrics("p1_derived_value{name=\"%s\"} %s\n", name, number);
+        }
+        if (m_metrics_full && m_num_metrics_truncations++ == 0) {
+            ESP_LOGW("p1reader", "Metrics do not fit in %d bytes, the last lines are left out", metrics_buffer_size);
+        }
+        m_metrics_length = static_cast<int>(m_metrics_position - m_metrics);
+    }
+
+    // Add to the metrics text, within the room that is left. Once something does not fit,
+    // the text is cut back to the last complete line and nothing more is added.
+    void AppendMetrics(char const *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        if (m_metrics_full) return;
+        int const room{ static_cast<int>(m_metrics + metrics_buffer_size - m_metrics_position) };
+        va_list arguments;
+        va_start(arguments, format);
+        int const length{ vsnprintf(m_metrics_position, room, format, arguments) };
+        va_end(arguments);
+        if (0 <= length && length < room) {
+            m_metrics_position += length;
+            return;
+        }
+        m_metrics_full = true;
+        while (m_metrics_position != m_metrics && m_metrics_position[-1] != '\n') --m_metrics_position;
+    }
+
+    // Cumulative buckets, sum and count, with the values scaled by 10^exponent
+    void AppendHistogram(char const *name, char const *labels, Histogram const &histogram, int8_t exponent)
+    {
+        bool const has_labels{ *labels != '\0' };
+        char const *const separator{ has_labels ? "," : "" };
+        char const *const open{ has_labels ? "{" : "" };
+        char const *const close{ has_labels ? "}" : "" };
+        char number[48];
+        uint32_t cumulative{ 0 };
+        for (int i = 0; i < Histogram::num_buckets - 1; ++i) {
+            cumulative += histogram.counts[i];
+            FormatDecimal(number, P1Decimal{ histogram.bounds[i], exponent }, 1);
+            AppendMetrics("%s_bucket{%s%sle=\"%s\"} %u\n", name, labels, separator, number, static_cast<unsigned>(cumulative));
+        }
+        FormatDecimal(number, P1Decimal{ static_cast<int64_t>(histogram.sum), exponent }, 1);
+        AppendMetrics("%s_bucket{%s%sle=\"+Inf\"} %u\n%s_sum%s%s%s %s\n%s_count%s%s%s %u\n", name, labels, separator,
+            static_cast<unsigned>(histogram.count), name, open, labels, close, number, name, open, labels, close,
+            static_cast<unsigned>(histogram.count));
+    }
+#endif
+
+#if defined(USE_ARDUINO) && defined(USE_WIFI)
+    // Accept clients and answer complete requests (read holding or input registers)
+    void ServeModbus()
+    {
+        WiFiClient client{ m_modbus->server.available() };
+        if (client) {
+            ModbusClient *slot{ nullptr };
+            for (ModbusClient &modbus_client : m_modbus->clients) {
+                if (!modbus_client.client.connected()) slot = &modbus_client;
+            }
+            if (slot == nullptr) {
+                ESP_LOGW("p1reader", "Too many Modbus clients");
+                client.stop();
+            } else {
+                // Answers are small, and should not wait for the previous one to be acknowledged
+                client.setNoDelay(true);
+                slot->client = client;
+                slot->position = slot->discard = 0;
+            }
+        }
+        for (ModbusClient &modbus_client : m_modbus->clients) {
+            WiFiClient &connection{ modbus_client.client };
+            while (connection.connected() && connection.available() > 0) {
+                if (modbus_client.discard != 0) {
+                    connection.read();
+                    if (--modbus_client.discard == 0) modbus_client.position = 0;
+                    continue;
+                }
+                modbus_client.request[modbus_client.position++] = static_cast<uint8_t>(connection.read());
+                // The MBAP header ends with the length of the rest (unit and PDU)
+                if (modbus_client.position < 7) continue;
+                int const size{ 6 + ((modbus_client.request[4] << 8) | modbus_client.request[5]) };
+                if (modbus_client.position < std::min(size, modbus_request_size)) continue;
+                AnswerModbusRequest(connection, modbus_client.request, size);
+                modbus_client.discard = size - modbus_client.position;
+                if (modbus_client.discard <= 0) {
+                    modbus_client.discard = 0;
+                    modbus_client.position = 0;
+                }
+            }
+        }
+    }
+
+    void AnswerModbusRequest(WiFiClient &connection, uint8_t const *request, int size)
+    {
+        uint8_t *const response{ m_modbus->response };
+        memcpy(response, request, 4); // Transaction and protocol
+        response[6] = request[6]; // Unit
+        uint8_t const function{ size >= 8 ? request[7] : uint8_t{ 0 } };
+        response[7] = function;
+        uint8_t exception{ 0 };
+        int data_length{ 0 };
+        if (function != 3 && function != 4) {
+            exception = 1; // Illegal function
+        } else if (size != modbus_request_size) {
+            exception = 3; // Illegal data value
+        } else {
+            int const address{ ((request[8] << 8) | request[9]) - modbus_base_address };
+            int const count{ (request[10] << 8) | request[11] };
+            if (count < 1 || count > 125) {
+                exception = 3;
+            } else if (address < 0 || address + count > modbus_num_registers) {
+                exception = 2; // Illegal data address
+            } else {
+                data_length = 2 * count;
+                response[8] = static_cast<uint8_t>(data_length);
+                memcpy(response + 9, m_modbus->registers + 2 * address, data_length);
+            }
+        }
+        int length;
+        if (exception != 0) {
+            response[7] = function | 0x80;
+            response[8] = exception;
+            length = 9;
+        } else {
+            length = 9 + data_length;
+        }
+        response[4] = static_cast<uint8_t>((length - 6) >> 8);
+        response[5] = static_cast<uint8_t>(length - 6);
+        connection.write(response, length);
+    }
+#endif
+
+    // Called when a message has been completely processed.
+    void MessageProcessed()
+    {
+        FinishLearningLayout();
+        if (m_data_format == data_formats::ASCII) {
+            std::swap(m_line_hash, m_previous_line_hash);
+            m_num_previous_lines = std::min(m_num_lines, max_lines);
+        } else {
+            m_num_previous_lines = 0;
+        }
+        PublishDerivedValues();
+        UpdatePeaks();
+        CommitSnapshot();
+        if (m_discovery) {
+            // Only the first valid message is used, even if nothing was discovered
+            m_discovery = false;
+            if (DiscoverSensors()) {
+                // The new sensors are not in the layout and have not been published yet
+                m_layout_length = 0;
+                m_num_previous_lines = 0;
+            }
+            delete[] m_unmatched_codes;
+            m_unmatched_codes = nullptr;
+        }
+    }
+
+    // The item for a value in a message. Codes without a sensor of their own (also those
+    // with an internal item) are noted for discovery.
+    SensorListItem *GetItemForValue(uint32_t obisCode)
+    {
+        SensorListItem *const item{ GetItem(obisCode) };
+        if (item == nullptr || item->m_internal) NoteUnmatchedCode(obisCode);
+        return item;
+    }
+
+    void NoteUnmatchedCode(uint32_t obisCode)
+    {
+        if (m_discovery && m_num_unmatched_codes < max_lines) {
+            m_unmatched_codes[m_num_unmatched_codes++] = obisCode;
+        }
+    }
+
+    // Find the dictionary entry for a code (or return false if there is none)
+    static bool FindDictionaryEntry(uint32_t obisCode, DictionaryEntry &entry)
+    {
+        static_assert(DictionarySorted(), "The OBIS dictionary must be sorted");
+        // Submeters are listed for channel 0
+        if ((obisCode >> 28) == 0) obisCode &= ~(0xfu << 24);
+        int low{ 0 }, high{ dictionary_size };
+        while (low < high) {
+            int const middle{ (low + high) / 2 };
+            memcpy_P(&entry, &dictionary[middle], sizeof(entry));
+            uint32_t const code{ DictionaryCode(entry) };
+            if (code == obisCode) return true;
+            if (code < obisCode) low = middle + 1;
+            else high = middle;
+        }
+        return false;
+    }
+
+    // Create sensors for the unmatched codes of the first valid message (returns false if
+    // there were none in the dictionary). Sensors are registered with the application, but
+    // clients that are already connected (Home Assistant) only see them after reconnecting.
+    bool DiscoverSensors()
+    {
+        uint32_t *const codes{ m_unmatched_codes };
+        int num_codes{ 0 };
+        DictionaryEntry entry;
+        for (int i = 0; i < m_num_unmatched_codes; ++i) {
+            if (FindDictionaryEntry(codes[i], entry)) codes[num_codes++] = codes[i];
+            else ESP_LOGD("p1reader", "No dictionary entry for 0x%x", codes[i]);
+        }
+        m_num_unmatched_codes = 0;
+        std::sort(codes, codes + num_codes);
+        num_codes = std::unique(codes, codes + num_codes) - codes;
+        if (num_codes == 0) return false;
+
+        DiscoveredSensorTable *const table{ new DiscoveredSensorTable(codes, num_codes) };
+        for (int i = 0; i < num_codes; ++i) {
+            uint32_t const code{ codes[i] };
+            FindDictionaryEntry(code, entry);
+            int const channel{ static_cast<int>(code >> 24) & 0xf };
+            char *const name{ table->Name(i) };
+            if ((code >> 28) == 0 && channel > 1) snprintf(name, DiscoveredSensorTable::name_length, "%s %d", entry.name, channel);
+            else snprintf(name, DiscoveredSensorTable::name_length, "%s", entry.name);
+            char *const object_id{ table->ObjectId(i) };
+            for (int j = 0; j < DiscoveredSensorTable::name_length; ++j) {
+                char const c{ name[j] };
+                object_id[j] = c == ' ' ? '_' : ('A' <= c && c <= 'Z' ? c - 'A' + 'a' : c);
+            }
+
+            Sensor *const sensor{ table->Item(i)->GetSensor() };
+            sensor->set_name(name);
+            sensor->set_object_id(object_id);
+            sensor->set_unit_of_measurement(UnitName(entry.unit));
+            sensor->set_device_class(DeviceClassName(entry.device_class));
+            sensor->set_state_class(entry.total_increasing ? sensor::STATE_CLASS_TOTAL_INCREASING : sensor::STATE_CLASS_MEASUREMENT);
+            sensor->set_accuracy_decimals(entry.accuracy_decimals);
+            App.register_sensor(sensor);
+#ifdef USE_API
+            // The API server subscribes to the sensors that exist at setup
+            if (api::global_api_server != nullptr) {
+                sensor->add_on_state_callback([sensor](float state) { api::global_api_server->on_sensor_update(sensor, state); });
+            }
+#endif
+            ESP_LOGI("p1reader", "Discovered %s (0x%x)", name, code);
+            AdoptInternalItem(table->Item(i));
+        }
+        m_discovered_table = table;
+        return true;
+    }
+
+    // A discovered sensor takes over the thresholds and latest value of the internal item
+    // for its code, if there is one. The discovered table is searched first, so the
+    // internal item is not used after this.
+    void AdoptInternalItem(SensorListItem *item)
+    {
+        for (SensorListItem *internal{ m_sensor_list }; internal != nullptr; internal = internal->Next()) {
+            if (!internal->m_internal || internal->GetCode() != item->GetCode()) continue;
+            item->m_thresholds = internal->m_thresholds;
+            item->m_has_value = internal->m_has_value;
+            item->m_value = internal->m_value;
+            item->m_time = internal->m_time;
+            std::swap(item->m_capture, internal->m_capture);
+            internal->m_thresholds = nullptr;
+            internal->m_has_value = false;
+            return;
+        }
+    }
+
+    static char const *UnitName(dictionary_units unit)
+    {
+        switch (unit) {
+        case dictionary_units::KWH: return "kWh";
+        case dictionary_units::KVARH: return "kvarh";
+        case dictionary_units::KW: return "kW";
+        case dictionary_units::KVAR: return "kvar";
+        case dictionary_units::VOLT: return "V";
+        case dictionary_units::AMPERE: return "A";
+        case dictionary_units::HERTZ: return "Hz";
+        case dictionary_units::CUBIC_METRE: return "m³";
+        default: return "";
+        }
+    }
+
+    static char const *DeviceClassName(dictionary_classes device_class)
+    {
+        switch (device_class) {
+        case dictionary_classes::ENERGY: return "energy";
+        case dictionary_classes::POWER: return "power";
+        case dictionary_classes::VOLTAGE: return "voltage";
+        case dictionary_classes::CURRENT: return "current";
+        case dictionary_classes::FREQUENCY: return "frequency";
+        case dictionary_classes::POWER_FACTOR: return "power_factor";
+        case dictionary_classes::GAS: return "gas";
+        default: return "";
+        }
+    }
+
+    // FNV-1a hash of a line
+    static uint32_t HashLine(char const *begin, char const *end)
+    {
+        uint32_t hash{ 2166136261u };
+        while (begin != end) hash = (hash ^ static_cast<uint8_t>(*begin++)) * 16777619u;
+        return hash;
+    }
+
+    bool LineUnchanged(int line) const
+    {
+        return line < m_num_previous_lines && m_line_hash[line] == m_previous_line_hash[line];
+    }
+
+    void FinishLearningLayout()
+    {
+        if (!m_learning_layout) return;
+        m_learning_layout = false;
+        m_layout_length = m_message_buffer_position;
+        m_layout_format = m_data_format;
+        m_layout_hash = LayoutHash();
+    }
+
+    // FNV-1a hash of the OBIS codes at the learned positions (and the type of each binary
+    // value) in the current message.
+    uint32_t LayoutHash() const
+    {
+        uint32_t hash{ 2166136261u };
+        for (int i = 0; i < m_layout_size; ++i) {
+            LayoutEntry const &entry{ m_layout[i] };
+            for (int j = 0; j < entry.obis_length; ++j) {
+                hash = (hash ^ static_cast<uint8_t>(m_message_buffer[entry.obis_offset + j])) * 16777619u;
+            }
+            if (m_data_format == data_formats::BINARY) {
+                hash = (hash ^ static_cast<uint8_t>(m_message_buffer[entry.value_offset])) * 16777619u;
+            }
+        }
+        return hash;
+    }
+
+    bool MatchesLayout() const
+    {
+        return m_layout_length == m_message_buffer_position && m_layout_format == m_data_format && m_layout_hash == LayoutHash();
+    }
+
+    // Read an unsigned big endian integer of num_bytes bytes.
+    static uint64_t ReadBigEndian(char const *position, int num_bytes)
+    {
+        uint64_t value{ 0 };
+        while (num_bytes--) value = value << 8 | static_cast<uint8_t>(*position++);
+        return value;
+    }
+
+    // Both CRCs use reflected polynomials and are calculated four bits at a time, using
+    // a 16 entry table for each polynomial.
+    static uint16_t crc16_reflected(uint16_t const *table, char const *pData, int length, uint16_t wCrc)
+    {
         while (length--) {
-            wCrc ^= *(unsigned char *)pData++;
-            for (i=0; i < 8; i++)
-                wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ 0xA001 : wCrc >> 1;
+            wCrc ^= *(unsigned char const *)pData++;
+            wCrc = (wCrc >> 4) ^ table[wCrc & 0x0f];
+            wCrc = (wCrc >> 4) ^ table[wCrc & 0x0f];
         }
         return wCrc;
     }
 
-    uint16_t crc16_x25(char* pData, int length) {
-        int i;
-        uint16_t wCrc = 0xffff;
-        while (length--) {
-            wCrc ^= *(unsigned char *)pData++ << 0;
-            for (i=0; i < 8; i++)
-                wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ 0x8408 : wCrc >> 1;
+    // ASCII messages (polynomial 0xA001)
+    uint16_t crc16_ccitt_false(char const *pData, int length, uint16_t wCrc = 0) {
+        static uint16_t const table[16]{
+            0x0000, 0xcc01, 0xd801, 0x1400, 0xf001, 0x3c00, 0x2800, 0xe401,
+            0xa001, 0x6c00, 0x7800, 0xb401, 0x5000, 0x9c01, 0x8801, 0x4400
+        };
+        return crc16_reflected(table, pData, length, wCrc);
+    }
+
+    // Binary (HDLC) and SML messages (polynomial 0x8408)
+    uint16_t crc16_x25(char const *pData, int length) {
+        static uint16_t const table[16]{
+            0x0000, 0x1081, 0x2102, 0x3183, 0x4204, 0x5285, 0x6306, 0x7387,
+            0x8408, 0x9489, 0xa50a, 0xb58b, 0xc60c, 0xd68d, 0xe70e, 0xf78f
+        };
+        return crc16_reflected(table, pData, length, 0xffff) ^ 0xffff;
+    }
+
+    // SML type-length field types
+    constexpr static uint8_t sml_octet_string{ 0x00 };
+    constexpr static uint8_t sml_signed{ 0x50 };
+    constexpr static uint8_t sml_unsigned{ 0x60 };
+    constexpr static uint8_t sml_list{ 0x70 };
+
+    // Read the type-length field of an SML element. For lists, length is the number of
+    // elements, otherwise the number of data bytes. Returns the start of the data, or
+    // nullptr if the field is malformed.
+    static uint8_t const *ReadSMLTypeLength(uint8_t const *position, uint8_t const *end, uint8_t &type, int &length)
+    {
+        uint8_t const *const start{ position };
+        if (position >= end) return nullptr;
+        type = *position & 0x70;
+        length = *position & 0x0f;
+        while (*position++ & 0x80) {
+            if (position >= end) return nullptr;
+            length = (length << 4) | (*position & 0x0f);
+        }
+        // For everything but lists, the length includes the type-length field itself
+        if (type != sml_list) {
+            length -= position - start;
+            if (length < 0) return nullptr;
         }
-        return wCrc ^ 0xffff;
+        return position;
     }
 
+    // Skip an SML element (including everything in it, if it is a list).
+    static uint8_t const *SkipSMLElement(uint8_t const *position, uint8_t const *end, int depth = 0)
+    {
+        if (position >= end) return nullptr;
+        if (*position == 0x00) return position + 1; // End of message
+        uint8_t type;
+        int length;
+        position = ReadSMLTypeLength(position, end, type, length);
+        if (position == nullptr) return nullptr;
+        if (type != sml_list) return position + length <= end ? position + length : nullptr;
+        if (depth == 8) return nullptr;
+        while (length-- != 0 && position != nullptr) position = SkipSMLElement(position, end, depth + 1);
+        return position;
+    }
+
+    // Read an optional SML integer (signed or unsigned, 1-8 bytes). Anything else is
+    // skipped and reported as not present.
+    static uint8_t const *ReadSMLInteger(uint8_t const *position, uint8_t const *end, int64_t &value, bool &present)
+    {
+        uint8_t type;
+        int length;
+        uint8_t const *const data{ ReadSMLTypeLength(position, end, type, length) };
+        present = data != nullptr && (type == sml_signed || type == sml_unsigned) && 0 < length && length <= 8 && data + length <= end;
+        if (!present) return SkipSMLElement(position, end);
+        uint64_t const raw{ ReadBigEndian(reinterpret_cast<char const *>(data), length) };
+        int const unused_bits{ 64 - 8 * length };
+        // Sign extend signed values by shifting up and back down
+        value = type == sml_signed ? static_cast<int64_t>(raw << unused_bits) >> unused_bits : static_cast<int64_t>(raw);
+        return data + length;
+    }
+
+    // Process one element of an SML message. Lists are entered and their elements are
+    // processed one at a time, except for the entries in the value list of a
+    // GetList.Res (lists of seven elements starting with a six byte OBIS code), which
+    // are decoded as a whole. Returns the start of the next element, or nullptr if the
+    // message is malformed.
+    uint8_t const *ProcessSMLElement(uint8_t const *position, uint8_t const *end)
+    {
+        if (*position == 0x00) return position + 1; // End of message (or padding)
+        uint8_t type;
+        int length;
+        uint8_t const *const data{ ReadSMLTypeLength(position, end, type, length) };
+        if (data == nullptr) return nullptr;
+        if (type != sml_list) return SkipSMLElement(position, end);
+        if (length != 7 || data + 7 > end || *data != 0x07) return data;
+
+        // objName, status, valTime, unit, scaler, value, valueSignature
+        uint8_t const *const obis{ data + 1 };
+        position = SkipSMLElement(data + 7, end);
+        if (position != nullptr) position = SkipSMLElement(position, end);
+        int64_t unit{ 0 }, scaler{ 0 }, value{ 0 };
+        bool has_unit, has_scaler, has_value;
+        if (position != nullptr) position = ReadSMLInteger(position, end, unit, has_unit);
+        if (position != nullptr) position = ReadSMLInteger(position, end, scaler, has_scaler);
+        if (position != nullptr) position = ReadSMLInteger(position, end, value, has_value);
+        if (position != nullptr) position = SkipSMLElement(position, end);
+        if (position == nullptr || !has_value) return position;
 
-    // Find the matching sensor in the linked list (or return nullptr
+        uint32_t const code{ OBIS(obis[0], obis[1], obis[2], obis[3], obis[4]) };
+        SensorListItem *const item{ GetItemForValue(code) };
+        if (item == nullptr) return position;
+        int exponent{ has_scaler ? static_cast<int>(scaler) : 0 };
+        char const *const unit_name{ has_unit ? DLMSUnitName(static_cast<int>(unit), exponent) : nullptr };
+        if (unit_name != nullptr) exponent += UnitExponent(item, unit_name, unit_name + strlen(unit_name));
+        PublishValue(item, P1Decimal{ value, static_cast<int8_t>(exponent) });
+        return position;
+    }
+
+
+    // Find the matching sensor in the table or the linked list (or return nullptr
     // if it does not exist.
-    Sensor *GetSensor(uint32_t obisCode) const
+    SensorListItem *GetItem(uint32_t obisCode) const
     {
+        if (m_sensor_table != nullptr) {
+            SensorListItem *item{ m_sensor_table->Find(obisCode) };
+            if (item != nullptr) return item;
+        }
+        if (m_discovered_table != nullptr) {
+            SensorListItem *item{ m_discovered_table->Find(obisCode) };
+            if (item != nullptr) return item;
+        }
         SensorListItem *sensor_list{ m_sensor_list };
         while (sensor_list != nullptr) {
-            if (obisCode == sensor_list->GetCode()) return sensor_list->GetSensor();
+            if (obisCode == sensor_list->GetCode()) return sensor_list;
             sensor_list = sensor_list->Next();
         }
+        // Some electricity meters (e.g. Kamstrup) report their values on channel 1. Let
+        // those match sensors added for channel 0.
+        constexpr uint32_t channel_mask{ 0xf << 24 };
+        if ((obisCode >> 28) == 1 && (obisCode & channel_mask) != 0) return GetItem(obisCode & ~channel_mask);
+        if (obisCode == telegram_time_code) return const_cast<SensorListItem *>(&m_telegram_time_item);
         return nullptr;
     }
 
+    // The item for a value that another feature needs (thresholds, derived values, peaks,
+    // Modbus). Values without a sensor get an internal item, which only keeps the latest
+    // value. Call from setup, once all sensors have been added.
+    SensorListItem *RequireItem(uint32_t obisCode)
+    {
+        SensorListItem *const item{ GetItem(obisCode) };
+        if (item != nullptr) return item;
+        m_sensor_list = new SensorListItem(m_sensor_list, obisCode);
+        m_sensor_list->m_internal = true;
+        return m_sensor_list;
+    }
+
+    Sensor *GetSensor(uint32_t obisCode) const
+    {
+        SensorListItem *item{ GetItem(obisCode) };
+        return item == nullptr ? nullptr : item->GetSensor();
+    }
+
+    // Go through all sensors, across several calls to loop() if needed.
+    void ResetItemCursor()
+    {
+        m_item_index = 0;
+        m_item_cursor = m_sensor_list;
+    }
+
+    SensorListItem *NextItem()
+    {
+        int const table_size{ m_sensor_table == nullptr ? 0 : m_sensor_table->Size() };
+        if (m_item_index < table_size) return m_sensor_table->Item(m_item_index++);
+        int const discovered_size{ m_discovered_table == nullptr ? 0 : m_discovered_table->Size() };
+        if (m_item_index < table_size + discovered_size) return m_discovered_table->Item(m_item_index++ - table_size);
+        SensorListItem *item{ m_item_cursor };
+        if (item != nullptr) m_item_cursor = item->Next();
+        return item;
+    }
+
 };
 
 int P1Reader::s_objects_created{ 0 };
+
+template <uint32_t... Codes>
+constexpr uint32_t P1Reader::StaticSensorTable<Codes...>::codes[];
+
+template <uint32_t... Codes>
+constexpr P1Reader::SortedSensorTable<sizeof...(Codes)> P1Reader::StaticSensorTable<Codes...>::sorted;
+
+constexpr P1Reader::DictionaryEntry P1Reader::dictionary[];
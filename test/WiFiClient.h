@@ -0,0 +1,53 @@
+// Host stand-in for the Arduino WiFiClient, on a non-blocking POSIX socket
+#pragma once
+#include <cstdint>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class WiFiClient {
+    int m_fd{ -1 };
+public:
+    WiFiClient() {}
+    explicit WiFiClient(int fd) : m_fd(fd) {}
+    explicit operator bool() const { return m_fd >= 0; }
+    uint8_t connected()
+    {
+        if (m_fd < 0) return 0;
+        char c;
+        if (recv(m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            stop();
+            return 0;
+        }
+        return 1;
+    }
+    int available()
+    {
+        int n{ 0 };
+        if (m_fd < 0 || ioctl(m_fd, FIONREAD, &n) != 0) return 0;
+        return n;
+    }
+    int read()
+    {
+        uint8_t c;
+        return recv(m_fd, &c, 1, MSG_DONTWAIT) == 1 ? c : -1;
+    }
+    size_t write(uint8_t const *data, size_t length)
+    {
+        ssize_t const written{ send(m_fd, data, length, MSG_NOSIGNAL) };
+        return written < 0 ? 0 : written;
+    }
+    void setNoDelay(bool on)
+    {
+        int const value{ on };
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof value);
+    }
+    void stop()
+    {
+        if (m_fd >= 0) close(m_fd);
+        m_fd = -1;
+    }
+};
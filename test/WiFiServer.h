@@ -0,0 +1,26 @@
+// Host stand-in for the Arduino WiFiServer, listening on the loopback interface
+#pragma once
+#include <arpa/inet.h>
+#include "WiFiClient.h"
+
+class WiFiServer {
+    int m_fd{ -1 };
+    uint16_t m_port;
+public:
+    explicit WiFiServer(uint16_t port) : m_port(port) {}
+    ~WiFiServer() { if (m_fd >= 0) close(m_fd); }
+    void begin()
+    {
+        m_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int const one{ 1 };
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(m_port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(m_fd, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0) perror("bind");
+        listen(m_fd, 4);
+        fcntl(m_fd, F_SETFL, O_NONBLOCK);
+    }
+    WiFiClient available() { return WiFiClient(accept(m_fd, nullptr, nullptr)); }
+};
@@ -0,0 +1,49 @@
+// Host stand-in for the Arduino WiFiUDP, sending real datagrams through a POSIX socket.
+// Multicast is looped back on the loopback interface so that a test can receive it.
+#pragma once
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+struct IPAddress {
+    uint8_t octets[4]{};
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets{ a, b, c, d } {}
+};
+
+class WiFiUDP {
+    int m_fd{ -1 };
+    sockaddr_in m_to{};
+    std::vector<uint8_t> m_packet;
+public:
+    ~WiFiUDP() { if (m_fd >= 0) close(m_fd); }
+    int beginPacket(IPAddress ip, uint16_t port)
+    {
+        if (m_fd < 0) {
+            m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+            unsigned char const loop{ 1 };
+            setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof loop);
+            in_addr interface_address;
+            interface_address.s_addr = htonl(INADDR_LOOPBACK);
+            setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface_address, sizeof interface_address);
+        }
+        m_to.sin_family = AF_INET;
+        m_to.sin_port = htons(port);
+        memcpy(&m_to.sin_addr, ip.octets, 4);
+        m_packet.clear();
+        return m_fd >= 0;
+    }
+    size_t write(uint8_t const *data, size_t length)
+    {
+        m_packet.insert(m_packet.end(), data, data + length);
+        return length;
+    }
+    int endPacket()
+    {
+        return sendto(m_fd, m_packet.data(), m_packet.size(), 0, reinterpret_cast<sockaddr *>(&m_to), sizeof m_to) == static_cast<ssize_t>(m_packet.size());
+    }
+};
@@ -0,0 +1,50 @@
+// Aggregation: the mean, minimum and maximum of momentary values over each period
+#include "p1test.h"
+
+static std::string PowerLine(char const *power)
+{
+    return AsciiTelegram(std::string{ "1-0:1.7.0(" } + power + "*kW)\r\n");
+}
+
+// A period without a new value publishes nothing, and the old value is not held into
+// the next period
+static void TestPeriodWithoutValue()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *const power{ reader.AddSensor(1, 7, 0) };
+    Sensor minimum;
+    Sensor maximum;
+    reader.AddAggregateSensors(&minimum, &maximum, 1, 0, 1, 7, 0);
+    reader.SetAggregationPeriod(10);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    // 1.2 s per message. The first period started at boot.
+    for (int i = 0; i < 20 && power->num_publishes == 0; ++i) Feed(uart, reader, PowerLine("0001.000"));
+    CHECK(power->num_publishes == 1);
+    for (int i = 0; i < 20 && power->num_publishes == 1; ++i) Feed(uart, reader, PowerLine(i % 2 == 0 ? "0001.000" : "0003.000"));
+    CHECK(power->num_publishes == 2);
+    CHECK(power->state > 1.0f && power->state < 3.0f);
+    CHECK_NEAR(minimum.state, 1.0);
+    CHECK_NEAR(maximum.state, 3.0);
+
+    // The meter stops sending the value for two periods
+    for (int i = 0; i < 20; ++i) Feed(uart, reader, AsciiTelegram("1-0:32.7.0(230.1*V)\r\n"));
+    CHECK(power->num_publishes == 2);
+    CHECK(minimum.num_publishes == 2);
+    CHECK(maximum.num_publishes == 2);
+
+    // The next period is only made of the values received in it
+    for (int i = 0; i < 20 && power->num_publishes == 2; ++i) Feed(uart, reader, PowerLine("0002.000"));
+    CHECK(power->num_publishes == 3);
+    CHECK_NEAR(power->state, 2.0);
+    CHECK_NEAR(minimum.state, 2.0);
+    CHECK_NEAR(maximum.state, 2.0);
+}
+
+int main()
+{
+    TestPeriodWithoutValue();
+    return TestResult("aggregate_test");
+}
@@ -0,0 +1,136 @@
+// ASCII (DSMR) messages: parsing, and what is passed on to a secondary P1 port
+#include "p1test.h"
+
+static std::string PowerLines(char const *power)
+{
+    return std::string{ "0-0:1.0.0(231016120000S)\r\n1-0:1.8.0(00012345.678*kWh)\r\n1-0:1.7.0(" } + power + "*kW)\r\n1-0:32.7.0(230.1*V)\r\n";
+}
+
+static void TestValues()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *const energy{ reader.AddSensor(1, 8, 0) };
+    Sensor *const power{ reader.AddSensor(1, 7, 0) };
+    Sensor *const voltage{ reader.AddSensor(32, 7, 0) };
+    reader.setup();
+    RunLoops(reader, 40);
+
+    Feed(uart, reader, AsciiTelegram(PowerLines("0001.234")));
+    CHECK_NEAR(energy->state, 12345.678);
+    CHECK_NEAR(power->state, 1.234);
+    CHECK_NEAR(voltage->state, 230.1);
+}
+
+// Values are converted to the unit of the sensor. Prefixes are case sensitive, the rest
+// of the unit is not.
+static void TestUnits()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *const power{ reader.AddSensor(1, 7, 0) };
+    Sensor *const export_power{ reader.AddSensor(2, 7, 0) };
+    Sensor *const reactive{ reader.AddSensor(3, 7, 0) };
+    Sensor *const energy{ reader.AddSensor(1, 8, 0) };
+    power->unit = "MW";
+    export_power->unit = "W";
+    reactive->unit = "mvar";
+    energy->unit = "Wh";
+    reader.setup();
+    RunLoops(reader, 40);
+
+    Feed(uart, reader, AsciiTelegram("1-0:1.7.0(0001.234*kW)\r\n1-0:2.7.0(0000.500*kw)\r\n1-0:3.7.0(0000.002*Mvar)\r\n1-0:1.8.0(00000012.345*kwh)\r\n"));
+    CHECK_NEAR(power->state, 0.001234);
+    CHECK_NEAR(export_power->state, 500.0);
+    CHECK_NEAR(reactive->state, 2000000.0);
+    CHECK_NEAR(energy->state, 12345.0);
+}
+
+// Each value keeps the time of the message it was last sent in
+static void TestValueTime()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    reader.AddSensor(1, 7, 0);
+    reader.AddSensor(0, 1, 24, 2, 1);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    uint32_t const gas{ P1Reader::OBIS(0, 1, 24, 2, 1) };
+    uint32_t const power{ P1Reader::OBIS(1, 7, 0) };
+    CHECK(reader.GetValueTime(power) == 0);
+    Feed(uart, reader, AsciiTelegram("0-0:1.0.0(231016120000S)\r\n1-0:1.7.0(0001.234*kW)\r\n0-1:24.2.1(231016115500S)(00123.456*m3)\r\n"));
+    // 2023-10-16 10:00:00 UTC
+    uint32_t const first_time{ 1697450400 };
+    CHECK(reader.GetTelegramTime() == first_time);
+    CHECK(reader.GetValueTime(power) == first_time);
+    CHECK(reader.GetValueTime(gas) == first_time);
+
+    Feed(uart, reader, AsciiTelegram("0-0:1.0.0(231016120010S)\r\n1-0:1.7.0(0001.250*kW)\r\n"));
+    CHECK(reader.GetTelegramTime() == first_time + 10);
+    CHECK(reader.GetValueTime(power) == first_time + 10);
+    CHECK(reader.GetValueTime(gas) == first_time);
+    CHECK(reader.GetValueTime(P1Reader::OBIS(2, 7, 0)) == 0);
+}
+
+// The start of the next message in the same read as the CRC line is not part of this one
+static void TestTrailingBytes()
+{
+    UARTComponent uart;
+    gpio::GPIOBinarySensor secondary_RTS;
+    secondary_RTS.state = true;
+    P1Reader reader{ &uart, nullptr, nullptr, nullptr, &secondary_RTS };
+    Sensor *const power{ reader.AddSensor(1, 7, 0) };
+    reader.setup();
+    RunLoops(reader, 40);
+
+    std::string const first{ AsciiTelegram(PowerLines("0001.234")) };
+    Feed(uart, reader, first + "/ELL5\\2538");
+    CHECK_NEAR(power->state, 1.234);
+    CHECK(uart.tx == first);
+
+    // The next complete message is read as usual
+    uart.tx.clear();
+    std::string const second{ AsciiTelegram(PowerLines("0002.500")) };
+    Feed(uart, reader, second);
+    CHECK_NEAR(power->state, 2.5);
+    CHECK(uart.tx == second);
+}
+
+// Discovery switched on after setup creates sensors for the next message, once
+static void TestDiscoveryAfterSetup()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *const power{ reader.AddSensor(1, 7, 0) };
+    reader.setup();
+    RunLoops(reader, 40);
+    Feed(uart, reader, AsciiTelegram(PowerLines("0001.234")));
+
+    size_t const num_registered{ App.sensors.size() };
+    reader.SetDiscovery(true);
+    Feed(uart, reader, AsciiTelegram(PowerLines("0001.500")));
+    CHECK_NEAR(power->state, 1.5);
+    // The energy register and the voltage, in the order of their codes
+    CHECK(App.sensors.size() == num_registered + 2);
+    if (App.sensors.size() != num_registered + 2) return;
+    Sensor *const energy{ App.sensors[num_registered] };
+    CHECK(energy->unit == "kWh");
+
+    Feed(uart, reader, AsciiTelegram(PowerLines("0001.750")));
+    CHECK(std::fabs(energy->state - 12345.678f) < 0.01f);
+    reader.SetDiscovery(true);
+    Feed(uart, reader, AsciiTelegram(PowerLines("0002.000")));
+    CHECK(App.sensors.size() == num_registered + 2);
+    CHECK_NEAR(power->state, 2.0);
+}
+
+int main()
+{
+    TestValues();
+    TestUnits();
+    TestValueTime();
+    TestTrailingBytes();
+    TestDiscoveryAfterSetup();
+    return TestResult("ascii_test");
+}
@@ -0,0 +1,295 @@
+// Host benchmarks of the parts of the reader that were optimized. The numbers are for
+// the PC the benchmark runs on, not for the ESP, and are only meant for comparing the
+// approaches with each other. Build with optimization:
+//   g++ -std=gnu++17 -O2 -I. -Itest test/benchmark.cpp -o benchmark && ./benchmark
+#include <chrono>
+#include "esphome.h"
+
+// The benchmarks time internal functions of the reader directly
+#define private public
+#include "p1test.h"
+#undef private
+
+// A message as sent by a Swedish meter every 10 s
+static std::string const swedish_lines{
+    "0-0:1.0.0(231016120000S)\r\n"
+    "1-0:1.8.0(00006678.394*kWh)\r\n"
+    "1-0:2.8.0(00000000.000*kWh)\r\n"
+    "1-0:3.8.0(00000021.988*kvarh)\r\n"
+    "1-0:4.8.0(00001020.971*kvarh)\r\n"
+    "1-0:1.7.0(0001.727*kW)\r\n"
+    "1-0:2.7.0(0000.000*kW)\r\n"
+    "1-0:3.7.0(0000.000*kvar)\r\n"
+    "1-0:4.7.0(0000.309*kvar)\r\n"
+    "1-0:21.7.0(0001.023*kW)\r\n"
+    "1-0:41.7.0(0000.350*kW)\r\n"
+    "1-0:61.7.0(0000.353*kW)\r\n"
+    "1-0:22.7.0(0000.000*kW)\r\n"
+    "1-0:42.7.0(0000.000*kW)\r\n"
+    "1-0:62.7.0(0000.000*kW)\r\n"
+    "1-0:23.7.0(0000.000*kvar)\r\n"
+    "1-0:43.7.0(0000.000*kvar)\r\n"
+    "1-0:63.7.0(0000.000*kvar)\r\n"
+    "1-0:24.7.0(0000.009*kvar)\r\n"
+    "1-0:44.7.0(0000.161*kvar)\r\n"
+    "1-0:64.7.0(0000.138*kvar)\r\n"
+    "1-0:32.7.0(240.3*V)\r\n"
+    "1-0:52.7.0(240.1*V)\r\n"
+    "1-0:72.7.0(241.3*V)\r\n"
+    "1-0:31.7.0(004.2*A)\r\n"
+    "1-0:51.7.0(001.6*A)\r\n"
+    "1-0:71.7.0(001.7*A)\r\n"
+};
+
+template <typename Function>
+static double NanosecondsPerCall(int num_calls, Function function)
+{
+    auto const start{ std::chrono::steady_clock::now() };
+    for (int i = 0; i < num_calls; ++i) function(i);
+    auto const end{ std::chrono::steady_clock::now() };
+    return std::chrono::duration<double, std::nano>(end - start).count() / num_calls;
+}
+
+// Finding the line feeds and the CRC marker of a message, a byte at a time and a word
+// at a time (FindLineFeedOrCRCMarker)
+static void BenchmarkScan()
+{
+    std::string message{ AsciiTelegram(swedish_lines) };
+    char *const begin{ &message[0] };
+    char *const end{ begin + message.size() };
+    int num_found{ 0 };
+    double const bytes{ NanosecondsPerCall(100000, [&](int) {
+        for (char *position{ begin }; ; ++position) {
+            while (position != end && *position != '\n' && *position != '!') ++position;
+            if (position == end) break;
+            ++num_found;
+        }
+        asm volatile("" ::: "memory");
+    }) };
+    double const words{ NanosecondsPerCall(100000, [&](int) {
+        for (char *position{ begin }; (position = P1Reader::FindLineFeedOrCRCMarker(position, end)) != end; ++position) ++num_found;
+        asm volatile("" ::: "memory");
+    }) };
+    printf("Scan of a %zu byte message for %d delimiters: byte loop %.0f ns, word scan %.0f ns\n", message.size(), num_found / 200000, bytes, words);
+}
+
+// Parsing the code and value of a line with sscanf and floating point, and with the
+// integer parsing that the reader uses (ParseUInt and ParseDecimal)
+static void BenchmarkParse()
+{
+    char const *const lines[]{ "1-0:1.8.0(00006678.394*kWh)", "1-0:32.7.0(240.3*V)", "1-0:21.7.0(0001.023*kW)" };
+    constexpr int num_lines{ 3 };
+    volatile float sink;
+    double const scanned{ NanosecondsPerCall(1000000, [&](int i) {
+        int a, b, major, minor, micro;
+        double value;
+        sscanf(lines[i % num_lines], "%d-%d:%d.%d.%d(%lf", &a, &b, &major, &minor, &micro, &value);
+        sink = static_cast<float>(value) + a + b + major + minor + micro;
+    }) };
+    double const parsed{ NanosecondsPerCall(1000000, [&](int i) {
+        char const *position{ lines[i % num_lines] };
+        int const a{ P1Reader::ParseUInt(position) };
+        int const b{ P1Reader::ParseUInt(++position) };
+        int const major{ P1Reader::ParseUInt(++position) };
+        int const minor{ P1Reader::ParseUInt(++position) };
+        int const micro{ P1Reader::ParseUInt(++position) };
+        P1Decimal value;
+        P1Reader::ParseDecimal(++position, value);
+        sink = value.ToFloat() + a + b + major + minor + micro;
+    }) };
+    printf("Parsing a line: sscanf %.0f ns, integer parsing %.0f ns\n", scanned, parsed);
+}
+
+// Looking up the sensor for each code of the Swedish message, with the sensors added one
+// at a time (a list) and with AddSensors (a table sorted at compile time)
+static void BenchmarkLookup()
+{
+    constexpr uint32_t codes[]{ P1Reader::OBIS(1, 8, 0), P1Reader::OBIS(2, 8, 0), P1Reader::OBIS(3, 8, 0),
+        P1Reader::OBIS(4, 8, 0), P1Reader::OBIS(1, 7, 0), P1Reader::OBIS(2, 7, 0), P1Reader::OBIS(3, 7, 0),
+        P1Reader::OBIS(4, 7, 0), P1Reader::OBIS(21, 7, 0), P1Reader::OBIS(41, 7, 0), P1Reader::OBIS(61, 7, 0),
+        P1Reader::OBIS(22, 7, 0), P1Reader::OBIS(42, 7, 0), P1Reader::OBIS(62, 7, 0), P1Reader::OBIS(23, 7, 0),
+        P1Reader::OBIS(43, 7, 0), P1Reader::OBIS(63, 7, 0), P1Reader::OBIS(24, 7, 0), P1Reader::OBIS(44, 7, 0),
+        P1Reader::OBIS(64, 7, 0), P1Reader::OBIS(32, 7, 0), P1Reader::OBIS(52, 7, 0), P1Reader::OBIS(72, 7, 0),
+        P1Reader::OBIS(31, 7, 0), P1Reader::OBIS(51, 7, 0), P1Reader::OBIS(71, 7, 0) };
+    constexpr int num_codes{ sizeof(codes) / sizeof(codes[0]) };
+    UARTComponent uart;
+    P1Reader list{ &uart };
+    for (uint32_t const code : codes) list.AddSensor(code >> 16 & 0xff, code >> 8 & 0xff, code & 0xff);
+    P1Reader table{ &uart };
+    table.AddSensors<codes[0], codes[1], codes[2], codes[3], codes[4], codes[5], codes[6], codes[7], codes[8],
+        codes[9], codes[10], codes[11], codes[12], codes[13], codes[14], codes[15], codes[16], codes[17], codes[18],
+        codes[19], codes[20], codes[21], codes[22], codes[23], codes[24], codes[25]>();
+    for (uint32_t const code : codes) {
+        if (list.GetItem(code) == nullptr || table.GetItem(code) == nullptr || list.GetItem(code)->GetCode() != table.GetItem(code)->GetCode()) {
+            printf("Lookup mismatch for 0x%x\n", code);
+        }
+    }
+    volatile uintptr_t sink;
+    double const listed{ NanosecondsPerCall(1000000, [&](int i) {
+        sink = reinterpret_cast<uintptr_t>(list.GetItem(codes[i % num_codes]));
+    }) };
+    double const sorted{ NanosecondsPerCall(1000000, [&](int i) {
+        sink = reinterpret_cast<uintptr_t>(table.GetItem(codes[i % num_codes]));
+    }) };
+    // A code in the message without a sensor
+    uint32_t const missing{ P1Reader::OBIS(0, 0, 96, 1, 0) };
+    double const listed_missing{ NanosecondsPerCall(1000000, [&](int) { sink = reinterpret_cast<uintptr_t>(list.GetItem(missing)); }) };
+    double const sorted_missing{ NanosecondsPerCall(1000000, [&](int) { sink = reinterpret_cast<uintptr_t>(table.GetItem(missing)); }) };
+    printf("Lookup among %d sensors: list %.1f ns, table %.1f ns; without a sensor: list %.1f ns, table %.1f ns (%zu bytes per sensor item)\n",
+        num_codes, listed, sorted, listed_missing, sorted_missing, sizeof(P1Reader::SensorListItem));
+}
+
+// A reader with a sensor for each value of the Swedish message
+static void AddSwedishSensors(P1Reader &reader, std::vector<Sensor *> &sensors)
+{
+    // The first line is the time of the message
+    char const *position{ strchr(swedish_lines.c_str(), '\n') + 1 };
+    for (; *position != '\0'; position = strchr(position, '\n') + 1) {
+        int const major{ atoi(position + 4) };
+        int const minor{ atoi(strchr(position, '.') + 1) };
+        sensors.push_back(reader.AddSensor(major, minor, 0));
+    }
+}
+
+// Let the reader finish the previous message, feed the next one and let the reader read it
+// and check the CRC. Returns the time spent in the processing state on its own (in
+// microseconds), and which processing state that was.
+static double ProcessMessage(P1Reader &reader, UARTComponent &uart, std::string const &message, P1Reader::states &processing)
+{
+    RunLoops(reader, 10);
+    for (char const c : message) uart.rx.push_back(c);
+    for (int step = 0; step < 100 && reader.m_state != P1Reader::states::PROCESSING_ASCII
+        && reader.m_state != P1Reader::states::PROCESSING_LAYOUT; ++step) {
+        g_millis += 20;
+        reader.RunState(g_millis);
+    }
+    processing = reader.m_state;
+    auto const start{ std::chrono::steady_clock::now() };
+    while (reader.m_state == processing) reader.RunState(g_millis);
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Processing the Swedish message by parsing every line, and with the layout learned from
+// the previous message. Every other message has its layout forgotten first, so that both
+// are timed on the same messages.
+static void BenchmarkLayout()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    std::vector<Sensor *> sensors;
+    AddSwedishSensors(reader, sensors);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    double full_parse{ 0 }, layout{ 0 };
+    int num_full_parses{ 0 }, num_layouts{ 0 };
+    constexpr int num_messages{ 2000 };
+    for (int i = 0; i < num_messages; ++i) {
+        // The energy register and the power change in each message, with the same length
+        std::string lines{ swedish_lines };
+        char value[16];
+        snprintf(value, sizeof value, "%08d.%03d", 6678 + i / 1000, i % 1000);
+        lines.replace(lines.find("00006678.394"), 12, value);
+        snprintf(value, sizeof value, "%04d.%03d", 1 + i % 3, i % 1000);
+        lines.replace(lines.find("0001.727"), 8, value);
+        if (i % 2 == 0) reader.m_layout_length = 0;
+        P1Reader::states processing;
+        double const time{ ProcessMessage(reader, uart, AsciiTelegram(lines), processing) };
+        if (processing == P1Reader::states::PROCESSING_ASCII) {
+            full_parse += time;
+            ++num_full_parses;
+        } else if (processing == P1Reader::states::PROCESSING_LAYOUT) {
+            layout += time;
+            ++num_layouts;
+        }
+    }
+    printf("Processing a message: full parse %.2f us, layout %.2f us (%d and %d messages)\n",
+        full_parse / num_full_parses, layout / num_layouts, num_full_parses, num_layouts);
+}
+
+// Consecutive Swedish messages, 10 s apart, from a house using about 1.7 kW. Momentary
+// values and the energy registers move with some noise, the export and capacitive values
+// stay at zero.
+static std::string SimulatedSwedishLines(int i, uint32_t &noise, double &energy, double &reactive_energy)
+{
+    auto const next_noise{ [&noise](int range) {
+        noise = noise * 1664525u + 1013904223u;
+        return static_cast<int>(noise >> 16) % (2 * range + 1) - range;
+    } };
+    int const seconds{ 12 * 3600 + 10 * i };
+    int const power[3]{ 1023 + next_noise(40), 350 + next_noise(20), 353 + next_noise(20) }; // W
+    int const reactive[3]{ 9 + next_noise(2), 161 + next_noise(5), 138 + next_noise(5) }; // var
+    int const voltage[3]{ 2403 + next_noise(4), 2401 + next_noise(4), 2413 + next_noise(4) }; // 0.1 V
+    int const total_power{ power[0] + power[1] + power[2] };
+    int const total_reactive{ reactive[0] + reactive[1] + reactive[2] };
+    energy += total_power * 10.0 / 3600000.0;
+    reactive_energy += total_reactive * 10.0 / 3600000.0;
+
+    char lines[1024];
+    int length{ snprintf(lines, sizeof lines, "0-0:1.0.0(231016%02d%02d%02dS)\r\n", seconds / 3600 % 24, seconds / 60 % 60, seconds % 60) };
+    length += snprintf(lines + length, sizeof lines - length, "1-0:1.8.0(%012.3f*kWh)\r\n1-0:2.8.0(00000000.000*kWh)\r\n"
+        "1-0:3.8.0(00000021.988*kvarh)\r\n1-0:4.8.0(%012.3f*kvarh)\r\n", energy, reactive_energy);
+    length += snprintf(lines + length, sizeof lines - length, "1-0:1.7.0(%04d.%03d*kW)\r\n1-0:2.7.0(0000.000*kW)\r\n"
+        "1-0:3.7.0(0000.000*kvar)\r\n1-0:4.7.0(%04d.%03d*kvar)\r\n", total_power / 1000, total_power % 1000, total_reactive / 1000, total_reactive % 1000);
+    for (int phase = 0; phase < 3; ++phase) {
+        length += snprintf(lines + length, sizeof lines - length, "1-0:%d.7.0(0000.%03d*kW)\r\n", 21 + 20 * phase, power[phase]);
+    }
+    for (int phase = 0; phase < 3; ++phase) length += snprintf(lines + length, sizeof lines - length, "1-0:%d.7.0(0000.000*kW)\r\n", 22 + 20 * phase);
+    for (int phase = 0; phase < 3; ++phase) length += snprintf(lines + length, sizeof lines - length, "1-0:%d.7.0(0000.000*kvar)\r\n", 23 + 20 * phase);
+    for (int phase = 0; phase < 3; ++phase) {
+        length += snprintf(lines + length, sizeof lines - length, "1-0:%d.7.0(0000.%03d*kvar)\r\n", 24 + 20 * phase, reactive[phase]);
+    }
+    for (int phase = 0; phase < 3; ++phase) {
+        length += snprintf(lines + length, sizeof lines - length, "1-0:%d.7.0(%03d.%d*V)\r\n", 32 + 20 * phase, voltage[phase] / 10, voltage[phase] % 10);
+    }
+    for (int phase = 0; phase < 3; ++phase) {
+        int const current{ power[phase] * 100 / voltage[phase] }; // 0.1 A
+        length += snprintf(lines + length, sizeof lines - length, "1-0:%d.7.0(%03d.%d*A)\r\n", 31 + 20 * phase, current / 10, current % 10);
+    }
+    return lines;
+}
+
+// Skipping the lines that are the same as in the previous message. Every other message is
+// processed with the previous hashes forgotten, so that both ways see the same messages.
+static void BenchmarkUnchangedLines()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    std::vector<Sensor *> sensors;
+    AddSwedishSensors(reader, sensors);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    uint32_t noise{ 1 };
+    double energy{ 6678.394 }, reactive_energy{ 1020.971 };
+    double time[2]{};
+    int num_publishes[2]{}, num_skipped_lines{ 0 };
+    constexpr int num_messages{ 2000 };
+    for (int i = 0; i < num_messages; ++i) {
+        bool const skipping{ i % 2 == 1 };
+        if (!skipping) reader.m_num_previous_lines = 0;
+        int publishes_before{ 0 };
+        for (Sensor const *sensor : sensors) publishes_before += sensor->num_publishes;
+        P1Reader::states processing;
+        time[skipping] += ProcessMessage(reader, uart, AsciiTelegram(SimulatedSwedishLines(i, noise, energy, reactive_energy)), processing);
+        if (skipping) num_skipped_lines += reader.m_num_unchanged_lines;
+        // Some states may be queued to be published in the following loops
+        RunLoops(reader, 10);
+        for (Sensor const *sensor : sensors) num_publishes[skipping] += sensor->num_publishes;
+        num_publishes[skipping] -= publishes_before;
+    }
+    int const half{ num_messages / 2 };
+    printf("Unchanged lines: %.1f of %zu lines skipped, publishes %.1f instead of %.1f, processing %.2f us instead of %.2f us per message\n",
+        static_cast<double>(num_skipped_lines) / half, sensors.size() + 1, static_cast<double>(num_publishes[1]) / half,
+        static_cast<double>(num_publishes[0]) / half, time[1] / half, time[0] / half);
+}
+
+int main()
+{
+    BenchmarkScan();
+    BenchmarkParse();
+    BenchmarkLookup();
+    BenchmarkLayout();
+    BenchmarkUnchangedLines();
+    return 0;
+}
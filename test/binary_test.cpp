@@ -0,0 +1,59 @@
+// Binary (DLMS/COSEM in HDLC frames) messages
+#include "p1test.h"
+
+// A frame with the time, the import register in Wh, the L1 voltage in 0.1 V and the L1
+// current with the given scaler
+static std::vector<uint8_t> BinaryTelegram(uint32_t energy, int16_t voltage, uint16_t current, int8_t current_scaler)
+{
+    std::vector<uint8_t> frame{ 0x7e, 0xa0, 0x00, 0x41, 0x08, 0x83, 0x13, 0x12, 0x34, 0xe6, 0xe7, 0x00, 0x0f, 0x40, 0x00, 0x00, 0x00,
+        0x09, 0x0c, 0x07, 0xe7, 0x0a, 0x10, 0x01, 0x0c, 0x00, 0x00, 0xff, 0x80, 0x00, 0x80,
+        0x01, 0x04,
+        0x02, 0x02, 0x09, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0xff, 0x09, 0x0c, 0x07, 0xe7, 0x0a, 0x10, 0x01, 0x0c, 0x00, 0x00, 0xff, 0x80, 0x00, 0x80,
+        0x02, 0x03, 0x09, 0x06, 0x01, 0x00, 0x01, 0x08, 0x00, 0xff, 0x06, uint8_t(energy >> 24), uint8_t(energy >> 16), uint8_t(energy >> 8), uint8_t(energy),
+        0x02, 0x02, 0x0f, 0x00, 0x16, 0x1e,
+        0x02, 0x03, 0x09, 0x06, 0x01, 0x00, 0x20, 0x07, 0x00, 0xff, 0x12, uint8_t(uint16_t(voltage) >> 8), uint8_t(voltage),
+        0x02, 0x02, 0x0f, 0xff, 0x16, 0x23,
+        0x02, 0x03, 0x09, 0x06, 0x01, 0x00, 0x1f, 0x07, 0x00, 0xff, 0x10, uint8_t(current >> 8), uint8_t(current),
+        0x02, 0x02, 0x0f, uint8_t(current_scaler), 0x16, 0x21 };
+    // Frame length without the flags, but with the CRC
+    size_t const length{ frame.size() - 1 + 2 };
+    frame[1] |= length >> 8;
+    frame[2] = length & 0xff;
+    uint16_t const crc{ Crc16X25(frame, 1, frame.size()) };
+    frame.push_back(crc & 0xff);
+    frame.push_back(crc >> 8);
+    frame.push_back(0x7e);
+    return frame;
+}
+
+static void TestValues()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *const energy{ reader.AddSensor(1, 8, 0) };
+    Sensor *const voltage{ reader.AddSensor(32, 7, 0) };
+    Sensor *const current{ reader.AddSensor(31, 7, 0) };
+    reader.setup();
+    RunLoops(reader, 40);
+
+    // Both bytes of this CRC have the high bit set
+    std::vector<uint8_t> const frame{ BinaryTelegram(1234567, 2301, 42, -2) };
+    CHECK(frame[frame.size() - 3] >= 0x80 && frame[frame.size() - 2] >= 0x80);
+    Feed(uart, reader, frame);
+    CHECK_NEAR(energy->state, 1234.567);
+    CHECK_NEAR(voltage->state, 230.1);
+    CHECK_NEAR(current->state, 0.42);
+
+    // A damaged frame is ignored
+    std::vector<uint8_t> damaged{ BinaryTelegram(1234999, 2302, 43, -2) };
+    damaged[damaged.size() - 2] ^= 0x01;
+    Feed(uart, reader, damaged);
+    CHECK_NEAR(energy->state, 1234.567);
+    CHECK_NEAR(voltage->state, 230.1);
+}
+
+int main()
+{
+    TestValues();
+    return TestResult("binary_test");
+}
@@ -0,0 +1,77 @@
+// P1Decimal: exact scaling over the whole int64 range, and values that do not fit
+#include "p1test.h"
+
+static void TestPowerOfTen()
+{
+    CHECK(P1Decimal::PowerOfTen(0) == 1);
+    CHECK(P1Decimal::PowerOfTen(12) == 1000000000000);
+    CHECK(P1Decimal::PowerOfTen(13) == 10000000000000);
+    CHECK(P1Decimal::PowerOfTen(P1Decimal::max_exponent) == 1000000000000000000);
+}
+
+static void TestToMantissa()
+{
+    int64_t mantissa;
+    CHECK(P1Decimal({ 123456789012345678, -6 }).ToMantissa(-3, mantissa) && mantissa == 123456789012345);
+    CHECK(P1Decimal({ 1234, 15 }).ToMantissa(0, mantissa) && mantissa == 1234000000000000000);
+    CHECK(P1Decimal({ -9, 18 }).ToMantissa(0, mantissa) && mantissa == -9000000000000000000);
+    CHECK(P1Decimal({ 5, 13 }).ToMantissa(-3, mantissa) && mantissa == 50000000000000000);
+
+    // Too large for the mantissa
+    CHECK(!P1Decimal({ 1234, 16 }).ToMantissa(0, mantissa));
+    CHECK(!P1Decimal({ 1, 19 }).ToMantissa(0, mantissa));
+    CHECK(!P1Decimal({ -1, 40 }).ToMantissa(-3, mantissa));
+    CHECK(P1Decimal({ 0, 40 }).ToMantissa(-3, mantissa) && mantissa == 0);
+
+    // Digits below the target exponent are dropped
+    CHECK(P1Decimal({ 123456, -25 }).ToMantissa(-3, mantissa) && mantissa == 0);
+    CHECK(P1Decimal({ INT64_MAX, -19 }).ToMantissa(0, mantissa) && mantissa == 0);
+    CHECK(P1Decimal({ INT64_MAX, -18 }).ToMantissa(0, mantissa) && mantissa == 9);
+}
+
+static void TestToFloat()
+{
+    CHECK_NEAR(P1Decimal({ 123456789012345678, -6 }).ToFloat(), 123456789012.345678);
+    CHECK_NEAR(P1Decimal({ 5, 13 }).ToFloat(), 5e13);
+    CHECK_NEAR(P1Decimal({ 1234, 16 }).ToFloat(), 1.234e19);
+    CHECK_NEAR(P1Decimal({ -7, 30 }).ToFloat(), -7e30);
+    CHECK_NEAR(P1Decimal({ 123456, -20 }).ToFloat(), 1.23456e-15);
+}
+
+// Large cumulative registers through the reader, also rescaled to the unit of the sensor
+static void TestLargeRegisters()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *const energy{ reader.AddSensor(1, 8, 0) };
+    Sensor *const energy_mWh{ reader.AddSensor(2, 8, 0) };
+    Sensor *const reactive{ reader.AddSensor(3, 8, 0) };
+    energy->unit = "kWh";
+    energy_mWh->unit = "mWh";
+    reactive->unit = "kvarh";
+    int64_t energy_mantissa{ 0 };
+    reader.AddOnTelegramCallback([&](P1Snapshot const &snapshot) {
+        P1Decimal const *const value{ snapshot.Find(P1Reader::OBIS(1, 8, 0)) };
+        if (value == nullptr || !value->ToMantissa(-3, energy_mantissa)) energy_mantissa = -1;
+    });
+    reader.setup();
+    RunLoops(reader, 40);
+
+    Feed(uart, reader, AsciiTelegram(
+        "1-0:1.8.0(123456789012.345678*kWh)\r\n"
+        "1-0:2.8.0(12345678901234567890*Wh)\r\n"
+        "1-0:3.8.0(99999999.999*Mvarh)\r\n"));
+    CHECK(energy_mantissa == 123456789012345);
+    CHECK_NEAR(energy->state, 123456789012.345678);
+    CHECK_NEAR(energy_mWh->state, 1.2345678901234568e22);
+    CHECK_NEAR(reactive->state, 99999999999.0);
+}
+
+int main()
+{
+    TestPowerOfTen();
+    TestToMantissa();
+    TestToFloat();
+    TestLargeRegisters();
+    return TestResult("decimal_test");
+}
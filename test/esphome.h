@@ -0,0 +1,197 @@
+//-------------------------------------------------------------------------------------
+// Host stand-in for the parts of ESPHome that p1mini.h uses, so that the reader can be
+// compiled and fed messages on a PC. Sensors record what was published, the UART is a
+// queue filled by the test and the network classes are backed by POSIX sockets.
+//-------------------------------------------------------------------------------------
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#define USE_ARDUINO
+#define USE_WIFI
+#define USE_WEBSERVER
+#define USE_TEXT_SENSOR
+
+#define PROGMEM
+#define memcpy_P memcpy
+
+// Warnings and errors are always shown, the rest only with P1TEST_VERBOSE set
+#define P1TEST_LOG(level, ...) (printf(level " " __VA_ARGS__), printf("\n"))
+#define ESP_LOGE(tag, ...) P1TEST_LOG("E", __VA_ARGS__)
+#define ESP_LOGW(tag, ...) P1TEST_LOG("W", __VA_ARGS__)
+#define ESP_LOGI(tag, ...) (getenv("P1TEST_VERBOSE") ? P1TEST_LOG("I", __VA_ARGS__) : 0)
+#define ESP_LOGD(tag, ...) (getenv("P1TEST_VERBOSE") ? P1TEST_LOG("D", __VA_ARGS__) : 0)
+#define ESP_LOGV(tag, ...) do {} while (0)
+
+// The clock is advanced by the test
+extern unsigned long g_millis, g_micros;
+inline unsigned long millis() { return g_millis; }
+inline unsigned long micros() { return g_micros; }
+
+template <typename T> class CallbackManager;
+template <typename... Ts> class CallbackManager<void(Ts...)> {
+    std::vector<std::function<void(Ts...)>> m_callbacks;
+public:
+    void add(std::function<void(Ts...)> callback) { m_callbacks.push_back(std::move(callback)); }
+    void call(Ts... args) { for (auto &callback : m_callbacks) callback(args...); }
+};
+
+namespace esphome {
+
+class Component {
+public:
+    virtual ~Component() {}
+    virtual void setup() {}
+    virtual void loop() {}
+};
+
+namespace sensor {
+enum StateClass { STATE_CLASS_MEASUREMENT, STATE_CLASS_TOTAL_INCREASING };
+}
+
+class Sensor {
+public:
+    float state{ NAN };
+    std::string unit;
+    std::string name;
+    int num_publishes{ 0 };
+    void publish_state(float s) { state = s; ++num_publishes; }
+    std::string get_unit_of_measurement() { return unit; }
+    void set_unit_of_measurement(char const *u) { unit = u; }
+    void set_name(char const *n) { name = n; }
+    void set_object_id(char const *) {}
+    void set_device_class(char const *) {}
+    void set_state_class(sensor::StateClass) {}
+    void set_accuracy_decimals(int) {}
+    void add_on_state_callback(std::function<void(float)>) {}
+};
+
+class TextSensor {
+public:
+    std::string state;
+    int num_publishes{ 0 };
+    void publish_state(std::string const &s) { state = s; ++num_publishes; }
+};
+
+class Number {
+public:
+    float state{ 0 };
+};
+
+// Bytes pushed to rx by the test are read by the reader, and whatever the reader
+// writes ends up in tx.
+class UARTComponent {
+public:
+    std::deque<uint8_t> rx;
+    std::string tx;
+    uint32_t baud{ 115200 };
+    uint32_t get_baud_rate() { return baud; }
+    void write_array(uint8_t const *data, size_t length) { tx.append(reinterpret_cast<char const *>(data), length); }
+};
+
+class UARTDevice {
+    UARTComponent *m_parent;
+public:
+    UARTDevice(UARTComponent *parent) : m_parent(parent) {}
+    int available() { return m_parent->rx.size(); }
+    int read() { int const c{ m_parent->rx.front() }; m_parent->rx.pop_front(); return c; }
+    bool read_array(uint8_t *data, size_t length) { for (size_t i = 0; i < length; ++i) data[i] = read(); return true; }
+    void write(uint8_t c) { m_parent->tx.push_back(c); }
+    void write_array(uint8_t const *data, size_t length) { m_parent->write_array(data, length); }
+};
+
+namespace gpio {
+class GPIOSwitch {
+public:
+    bool state{ false };
+    void turn_on() { state = true; }
+    void turn_off() { state = false; }
+};
+class GPIOBinarySensor {
+public:
+    bool state{ false };
+};
+}
+
+class ESPPreferenceObject {
+public:
+    template <typename T> bool save(T const *) { return true; }
+    template <typename T> bool load(T *) { return false; }
+};
+struct Preferences {
+    template <typename T> ESPPreferenceObject make_preference(uint32_t, bool) { return {}; }
+};
+inline Preferences g_preferences;
+inline Preferences *global_preferences{ &g_preferences };
+
+struct Application {
+    std::vector<Sensor *> sensors;
+    void register_sensor(Sensor *sensor) { sensors.push_back(sensor); }
+};
+inline Application App;
+
+namespace wifi {
+struct WiFiComponent {
+    int wifi_rssi() { return -50; }
+};
+inline WiFiComponent *global_wifi_component{ nullptr };
+}
+
+}
+
+// The web server only records what the handlers send
+enum WebRequestMethod { HTTP_GET = 1 };
+
+class AsyncWebServerRequest {
+public:
+    std::string request_url;
+    int code{ 0 };
+    std::string content_type;
+    std::string body;
+    std::function<void()> disconnect;
+    explicit AsyncWebServerRequest(std::string url) : request_url(std::move(url)) {}
+    std::string url() const { return request_url; }
+    int method() const { return HTTP_GET; }
+    void send(int c, char const *type, std::string const &b) { code = c; content_type = type; body = b; }
+    void send_P(int c, char const *type, uint8_t const *data, size_t length) { code = c; content_type = type; body.assign(reinterpret_cast<char const *>(data), length); }
+    void onDisconnect(std::function<void()> callback) { disconnect = std::move(callback); }
+};
+
+class AsyncWebHandler {
+public:
+    virtual ~AsyncWebHandler() {}
+    virtual bool canHandle(AsyncWebServerRequest *) { return false; }
+    virtual void handleRequest(AsyncWebServerRequest *) {}
+};
+
+class AsyncEventSource : public AsyncWebHandler {
+public:
+    std::string url;
+    size_t clients{ 0 };
+    std::vector<std::tuple<std::string, std::string, uint32_t>> sent;
+    explicit AsyncEventSource(char const *u) : url(u) {}
+    size_t count() const { return clients; }
+    void send(char const *message, char const *event, uint32_t id) { sent.emplace_back(message, event, id); }
+};
+
+namespace esphome {
+namespace web_server_base {
+struct WebServerBase {
+    std::vector<AsyncWebHandler *> handlers;
+    void add_handler(AsyncWebHandler *handler) { handlers.push_back(handler); }
+};
+inline WebServerBase g_web_server_base;
+inline WebServerBase *global_web_server_base{ &g_web_server_base };
+}
+}
+
+using namespace esphome;
@@ -0,0 +1,78 @@
+// Prometheus metrics on /metrics: the values of the last message, and what is left out
+// when they do not fit
+#include "p1test.h"
+
+// The body of a GET /metrics, from the handler added last
+static std::string GetMetrics()
+{
+    AsyncWebServerRequest request{ "/metrics" };
+    auto const &handlers{ web_server_base::global_web_server_base->handlers };
+    for (auto handler{ handlers.rbegin() }; handler != handlers.rend(); ++handler) {
+        if (!(*handler)->canHandle(&request)) continue;
+        (*handler)->handleRequest(&request);
+        break;
+    }
+    if (request.disconnect) request.disconnect();
+    return request.body;
+}
+
+static bool HasLine(std::string const &metrics, std::string const &line)
+{
+    return metrics.find("\n" + line + "\n") != std::string::npos;
+}
+
+// Values with an integer part that does not fit in 32 bits are written out in full
+static void TestLargeValues()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    reader.AddSensor(1, 8, 0);
+    reader.AddSensor(2, 8, 0);
+    reader.AddSensor(1, 7, 0);
+    reader.SetMetrics(true);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    Feed(uart, reader, AsciiTelegram("1-0:1.8.0(5000000000.123*kWh)\r\n1-0:2.8.0(18446744073.5*kWh)\r\n1-0:1.7.0(-4294967296.25*kW)\r\n"));
+    std::string const metrics{ GetMetrics() };
+    CHECK(HasLine(metrics, "p1_value{obis=\"1-0:1.8.0\"} 5000000000.123"));
+    CHECK(HasLine(metrics, "p1_value{obis=\"1-0:2.8.0\"} 18446744073.5"));
+    CHECK(HasLine(metrics, "p1_value{obis=\"1-0:1.7.0\"} -4294967296.25"));
+}
+
+// Values that do not fit in the buffer are left out after the last complete line, and the
+// truncation is counted in the next metrics
+static void TestTruncation()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    std::string lines;
+    for (int i = 0; i < P1Snapshot::max_values; ++i) {
+        reader.AddSensor(0, 1, 100 + i, 7, 0);
+        lines += "0-1:" + std::to_string(100 + i) + ".7.0(-12345678901.1234567*kW)\r\n";
+    }
+    reader.SetMetrics(true);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    Feed(uart, reader, AsciiTelegram(lines));
+    std::string metrics{ GetMetrics() };
+    CHECK(HasLine(metrics, "p1reader_metrics_truncations_total 0"));
+    CHECK(metrics.size() < 6144);
+    CHECK(metrics.back() == '\n');
+    size_t const last_line{ metrics.rfind('\n', metrics.size() - 2) + 1 };
+    CHECK(metrics.compare(last_line, 19, "p1_value{obis=\"0-1:") == 0);
+    CHECK(metrics.compare(metrics.size() - 21, 21, "-12345678901.1234567\n") == 0);
+    CHECK(metrics.find("p1_derived_value") == std::string::npos);
+
+    Feed(uart, reader, AsciiTelegram(lines));
+    metrics = GetMetrics();
+    CHECK(HasLine(metrics, "p1reader_metrics_truncations_total 1"));
+}
+
+int main()
+{
+    TestLargeValues();
+    TestTruncation();
+    return TestResult("metrics_test");
+}
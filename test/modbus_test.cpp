@@ -0,0 +1,125 @@
+// Modbus TCP: a client reads the SunSpec three phase meter model (203) back, including
+// values that only fit with a raised scale factor
+#include "p1test.h"
+#include <arpa/inet.h>
+
+static uint16_t const port{ 45502 };
+
+static int Connect()
+{
+    int const fd{ socket(AF_INET, SOCK_STREAM, 0) };
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0) {
+        close(fd);
+        return -1;
+    }
+    timeval timeout{ 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    return fd;
+}
+
+// Read holding registers (function 3) from the reader, empty on an error
+static std::vector<uint16_t> ReadRegisters(int fd, P1Reader &reader, uint16_t address, uint16_t count)
+{
+    static uint16_t transaction{ 0 };
+    ++transaction;
+    uint8_t const request[]{ uint8_t(transaction >> 8), uint8_t(transaction), 0, 0, 0, 6, 1, 3,
+        uint8_t(address >> 8), uint8_t(address), uint8_t(count >> 8), uint8_t(count) };
+    send(fd, request, sizeof request, 0);
+    RunLoops(reader, 5);
+
+    std::vector<uint8_t> response(9 + 2 * count);
+    size_t received{ 0 };
+    while (received < response.size()) {
+        ssize_t const length{ recv(fd, response.data() + received, response.size() - received, 0) };
+        if (length <= 0) break;
+        received += length;
+    }
+    std::vector<uint16_t> registers;
+    if (received != response.size() || response[0] != request[0] || response[1] != request[1] || response[7] != 3 || response[8] != 2 * count) return registers;
+    for (int i = 0; i < count; ++i) registers.push_back(static_cast<uint16_t>(response[9 + 2 * i] << 8 | response[10 + 2 * i]));
+    return registers;
+}
+
+// Registers of model 203, from its ID, length and the 105 registers of data
+struct MeterModel {
+    std::vector<uint16_t> registers;
+    int16_t Int16(int offset) const { return static_cast<int16_t>(registers[2 + offset]); }
+    uint32_t Acc32(int offset) const { return uint32_t{ registers[2 + offset] } << 16 | registers[3 + offset]; }
+};
+
+static MeterModel ReadMeterModel(int fd, P1Reader &reader)
+{
+    // After SunS, the ID and length of the common model, and its 66 registers
+    return MeterModel{ ReadRegisters(fd, reader, 40000 + 2 + 2 + 66, 2 + 105) };
+}
+
+static std::string ThreePhaseLines(char const *import_power, char const *export_power, char const *phase_import, char const *phase_export, char const *current_l1)
+{
+    std::string lines{ "1-0:1.8.0(00012345.678*kWh)\r\n1-0:2.8.0(00000123.456*kWh)\r\n" };
+    lines += std::string{ "1-0:1.7.0(" } + import_power + "*kW)\r\n1-0:2.7.0(" + export_power + "*kW)\r\n";
+    for (int phase : { 21, 41, 61 }) {
+        lines += "1-0:" + std::to_string(phase) + ".7.0(" + phase_import + "*kW)\r\n";
+        lines += "1-0:" + std::to_string(phase + 1) + ".7.0(" + phase_export + "*kW)\r\n";
+    }
+    lines += "1-0:32.7.0(230.1*V)\r\n1-0:52.7.0(231.0*V)\r\n1-0:72.7.0(229.9*V)\r\n";
+    lines += std::string{ "1-0:31.7.0(" } + current_l1 + "*A)\r\n1-0:51.7.0(005.00*A)\r\n1-0:71.7.0(005.00*A)\r\n";
+    return lines;
+}
+
+static void TestMeterModel()
+{
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    reader.AddSensor(1, 7, 0);
+    reader.SetModbusServer(port);
+    reader.setup();
+    RunLoops(reader, 40);
+    int const fd{ Connect() };
+    CHECK(fd >= 0);
+    if (fd < 0) return;
+
+    // 40.5 kW and 400 A do not fit in W and 0.01 A
+    Feed(uart, reader, AsciiTelegram(ThreePhaseLines("40.500", "00.000", "13.500", "00.000", "400.00")));
+    MeterModel meter{ ReadMeterModel(fd, reader) };
+    CHECK(meter.registers.size() == 107);
+    if (meter.registers.size() != 107) return;
+    CHECK(meter.registers[0] == 203);
+    CHECK(meter.registers[1] == 105);
+    CHECK(meter.Int16(16) == 4050);
+    CHECK(meter.Int16(17) == 1350);
+    CHECK(meter.Int16(19) == 1350);
+    CHECK(meter.Int16(20) == 1);
+    CHECK(meter.Int16(0) == 4100);
+    CHECK(meter.Int16(1) == 4000);
+    CHECK(meter.Int16(2) == 50);
+    CHECK(meter.Int16(4) == -1);
+    CHECK(meter.Int16(5) == 2303);
+    CHECK(meter.Int16(6) == 2301);
+    CHECK(meter.Int16(8) == 2299);
+    CHECK(meter.Int16(13) == -1);
+    CHECK(meter.Acc32(36) == 123456);
+    CHECK(meter.Acc32(44) == 12345678);
+
+    // The scale factors go back down for the next message, and export is negative
+    Feed(uart, reader, AsciiTelegram(ThreePhaseLines("00.000", "01.234", "00.000", "00.411", "005.00")));
+    meter = ReadMeterModel(fd, reader);
+    CHECK(meter.registers.size() == 107);
+    if (meter.registers.size() != 107) return;
+    CHECK(meter.Int16(16) == -1234);
+    CHECK(meter.Int16(17) == -411);
+    CHECK(meter.Int16(20) == 0);
+    CHECK(meter.Int16(0) == 1500);
+    CHECK(meter.Int16(1) == 500);
+    CHECK(meter.Int16(4) == -2);
+    close(fd);
+}
+
+int main()
+{
+    TestMeterModel();
+    return TestResult("modbus_test");
+}
@@ -0,0 +1,110 @@
+// UDP multicast: the datagram with the snapshot of each message, as a controller on the
+// local network receives it
+#include "p1test.h"
+
+static uint16_t const port{ 45001 };
+
+// A socket that has joined 239.255.1.1 on the loopback interface
+static int JoinGroup()
+{
+    int const fd{ socket(AF_INET, SOCK_DGRAM, 0) };
+    int const reuse{ 1 };
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0) return -1;
+    ip_mreq membership{};
+    membership.imr_multiaddr.s_addr = inet_addr("239.255.1.1");
+    membership.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof membership) != 0) return -1;
+    timeval timeout{ 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    return fd;
+}
+
+static uint64_t GetBigEndian(uint8_t const *position, int length)
+{
+    uint64_t value{ 0 };
+    for (int i = 0; i < length; ++i) value = value << 8 | position[i];
+    return value;
+}
+
+struct Datagram {
+    bool received{ false };
+    uint32_t sequence{ 0 };
+    uint32_t time{ 0 };
+    std::vector<std::pair<uint32_t, double> > values;
+
+    double Value(uint32_t code) const
+    {
+        for (auto const &value : values) {
+            if (value.first == code) return value.second;
+        }
+        return NAN;
+    }
+};
+
+static Datagram Receive(int fd)
+{
+    Datagram result;
+    uint8_t buffer[1500];
+    ssize_t const length{ recv(fd, buffer, sizeof buffer, 0) };
+    if (length < 12 || buffer[0] != 'P' || buffer[1] != '1' || buffer[2] != 1) return result;
+    int const num_values{ buffer[3] };
+    if (length != 12 + 13 * num_values) return result;
+    result.received = true;
+    result.sequence = static_cast<uint32_t>(GetBigEndian(buffer + 4, 4));
+    result.time = static_cast<uint32_t>(GetBigEndian(buffer + 8, 4));
+    for (int i = 0; i < num_values; ++i) {
+        uint8_t const *const value{ buffer + 12 + 13 * i };
+        int64_t const mantissa{ static_cast<int64_t>(GetBigEndian(value + 4, 8)) };
+        int8_t const exponent{ static_cast<int8_t>(value[12]) };
+        result.values.emplace_back(static_cast<uint32_t>(GetBigEndian(value, 4)), mantissa * std::pow(10.0, exponent));
+    }
+    return result;
+}
+
+static void TestDatagrams()
+{
+    int const fd{ JoinGroup() };
+    CHECK(fd >= 0);
+    if (fd < 0) return;
+
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    reader.AddSensor(1, 8, 0);
+    reader.AddSensor(1, 7, 0);
+    reader.AddSensor(2, 7, 0);
+    reader.SetMulticast(IPAddress(239, 255, 1, 1), port);
+    reader.setup();
+    RunLoops(reader, 40);
+
+    Feed(uart, reader, AsciiTelegram("0-0:1.0.0(231016120000S)\r\n1-0:1.8.0(00012345.678*kWh)\r\n1-0:1.7.0(0001.234*kW)\r\n1-0:2.7.0(-0000.500*kW)\r\n"));
+    Datagram const first{ Receive(fd) };
+    CHECK(first.received);
+    // 2023-10-16 10:00:00 UTC
+    CHECK(first.time == 1697450400);
+    CHECK(first.values.size() == 3);
+    CHECK_NEAR(first.Value(P1Reader::OBIS(1, 8, 0)), 12345.678);
+    CHECK_NEAR(first.Value(P1Reader::OBIS(1, 7, 0)), 1.234);
+    CHECK_NEAR(first.Value(P1Reader::OBIS(2, 7, 0)), -0.5);
+
+    // One datagram for each message, with the next sequence number
+    Feed(uart, reader, AsciiTelegram("0-0:1.0.0(231016120010S)\r\n1-0:1.8.0(00012345.682*kWh)\r\n1-0:1.7.0(0001.500*kW)\r\n1-0:2.7.0(0000.000*kW)\r\n"));
+    Datagram const second{ Receive(fd) };
+    CHECK(second.received);
+    CHECK(second.sequence == first.sequence + 1);
+    CHECK(second.time == first.time + 10);
+    CHECK_NEAR(second.Value(P1Reader::OBIS(1, 8, 0)), 12345.682);
+    CHECK_NEAR(second.Value(P1Reader::OBIS(1, 7, 0)), 1.5);
+    CHECK_NEAR(second.Value(P1Reader::OBIS(2, 7, 0)), 0.0);
+    close(fd);
+}
+
+int main()
+{
+    TestDatagrams();
+    return TestResult("multicast_test");
+}
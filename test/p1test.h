@@ -0,0 +1,78 @@
+//-------------------------------------------------------------------------------------
+// Shared helpers for the host tests: the clock, a check macro and message builders.
+// Each test is a single translation unit that includes this header.
+//-------------------------------------------------------------------------------------
+#pragma once
+#include "esphome.h"
+
+unsigned long g_millis{ 1000 };
+unsigned long g_micros{ 0 };
+
+#include "p1mini.h"
+
+static int g_num_failures{ 0 };
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++g_num_failures; \
+        } \
+    } while (0)
+
+// Floats are compared with a relative tolerance
+#define CHECK_NEAR(value, expected) CHECK(std::fabs((value) - (expected)) <= 1e-6 * std::max(1.0, std::fabs(double(expected))))
+
+inline int TestResult(char const *name)
+{
+    printf("%s: %s\n", name, g_num_failures == 0 ? "OK" : "FAILED");
+    return g_num_failures == 0 ? 0 : 1;
+}
+
+// Run the reader for a while, 20 ms per loop
+inline void RunLoops(P1Reader &reader, int num_loops)
+{
+    for (int i = 0; i < num_loops; ++i) {
+        g_millis += 20;
+        g_micros += 20000;
+        reader.loop();
+    }
+}
+
+template <typename Bytes>
+inline void Feed(UARTComponent &uart, P1Reader &reader, Bytes const &bytes, int num_loops = 60)
+{
+    for (auto const byte : bytes) uart.rx.push_back(static_cast<uint8_t>(byte));
+    RunLoops(reader, num_loops);
+}
+
+// CRC16/ARC, as used by DSMR
+inline uint16_t Crc16Arc(std::string const &data)
+{
+    uint16_t crc{ 0 };
+    for (unsigned char const byte : data) {
+        crc ^= byte;
+        for (int i = 0; i < 8; ++i) crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc;
+}
+
+// A complete ASCII message with the given data lines (each ending with \r\n)
+inline std::string AsciiTelegram(std::string const &lines)
+{
+    std::string message{ "/ELL5\\253833635_A\r\n\r\n" + lines + "!" };
+    char crc[8];
+    snprintf(crc, sizeof crc, "%04X\r\n", Crc16Arc(message));
+    return message + crc;
+}
+
+// CRC16/X25, as used by HDLC frames and SML
+inline uint16_t Crc16X25(std::vector<uint8_t> const &data, size_t begin, size_t end)
+{
+    uint16_t crc{ 0xffff };
+    for (size_t i = begin; i < end; ++i) {
+        crc ^= data[i];
+        for (int j = 0; j < 8; ++j) crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    }
+    return crc ^ 0xffff;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Build and run the host tests with the sanitizers: test/run.sh [name_test ...]
+cd "$(dirname "$0")/.." || exit 1
+CXX=${CXX:-g++}
+BUILD=${BUILD:-/tmp/p1mini-test}
+mkdir -p "$BUILD"
+if [ $# -eq 0 ]; then
+    set -- $(cd test && ls *_test.cpp | sed 's/\.cpp$//')
+fi
+status=0
+for name in "$@"; do
+    if ! $CXX -std=gnu++17 -O1 -g -Wall -Wno-format -fsanitize=address,undefined -I. -Itest "test/$name.cpp" -o "$BUILD/$name"; then
+        status=1
+        continue
+    fi
+    "$BUILD/$name" || status=1
+done
+exit $status
@@ -0,0 +1,130 @@
+// SML (Smart Message Language) messages: escaping, padding, the CRC and the values of a
+// GetList.Res
+#include "p1test.h"
+
+// An SML file around the body: the start sequence, the body with each aligned 1b1b1b1b
+// group sent twice, padding up to a multiple of four bytes and the end sequence with the
+// number of padding bytes and the CRC (low byte first).
+struct SmlFile {
+    std::vector<uint8_t> bytes;
+    int num_escapes{ 0 };
+    int num_padding_bytes{ 0 };
+};
+
+static SmlFile MakeSmlFile(std::vector<uint8_t> body)
+{
+    SmlFile file;
+    file.bytes = { 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01 };
+    while (body.size() % 4 != 0) {
+        body.push_back(0x00);
+        ++file.num_padding_bytes;
+    }
+    for (size_t i = 0; i < body.size(); i += 4) {
+        file.bytes.insert(file.bytes.end(), body.begin() + i, body.begin() + i + 4);
+        if (body[i] == 0x1b && body[i + 1] == 0x1b && body[i + 2] == 0x1b && body[i + 3] == 0x1b) {
+            file.bytes.insert(file.bytes.end(), body.begin() + i, body.begin() + i + 4);
+            ++file.num_escapes;
+        }
+    }
+    file.bytes.insert(file.bytes.end(), { 0x1b, 0x1b, 0x1b, 0x1b, 0x1a, static_cast<uint8_t>(file.num_padding_bytes) });
+    uint16_t const crc{ Crc16X25(file.bytes, 0, file.bytes.size()) };
+    file.bytes.push_back(crc & 0xff);
+    file.bytes.push_back(crc >> 8);
+    return file;
+}
+
+// An SML.PublicOpen.Res and a GetList.Res with the import register (unsigned, 0.1 Wh),
+// the total active power (signed, W) and the L1 voltage (unsigned, 0.1 V), followed by an
+// SML.PublicClose.Res
+static std::vector<uint8_t> GetListResponse(uint32_t energy, int32_t power, uint16_t voltage)
+{
+    return {
+        // SML.PublicOpen.Res
+        0x76, 0x05, 0x01, 0x02, 0x03, 0x04, 0x62, 0x00, 0x62, 0x00,
+        0x72, 0x63, 0x01, 0x01, 0x76, 0x01, 0x01, 0x07, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+        0x0c, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x01, 0x01,
+        0x63, 0x00, 0x00, 0x00,
+        // SML.GetList.Res: clientId, serverId, listName, actSensorTime
+        0x76, 0x05, 0x01, 0x02, 0x03, 0x05, 0x62, 0x00, 0x62, 0x00,
+        0x72, 0x63, 0x07, 0x01, 0x77, 0x01, 0x0b, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+        0x07, 0x01, 0x00, 0x62, 0x0a, 0xff, 0xff, 0x72, 0x62, 0x01, 0x65, 0x00, 0x00, 0x00, 0x01,
+        // valList: objName, status, valTime, unit, scaler, value, valueSignature
+        0x73,
+        0x77, 0x07, 0x01, 0x00, 0x01, 0x08, 0x00, 0xff, 0x65, 0x00, 0x00, 0x01, 0x82, 0x01, 0x62, 0x1e, 0x52, 0xff,
+        0x69, 0x00, 0x00, 0x00, 0x00, uint8_t(energy >> 24), uint8_t(energy >> 16), uint8_t(energy >> 8), uint8_t(energy), 0x01,
+        0x77, 0x07, 0x01, 0x00, 0x10, 0x07, 0x00, 0xff, 0x01, 0x01, 0x62, 0x1b, 0x52, 0x00,
+        0x55, uint8_t(uint32_t(power) >> 24), uint8_t(uint32_t(power) >> 16), uint8_t(uint32_t(power) >> 8), uint8_t(power), 0x01,
+        0x77, 0x07, 0x01, 0x00, 0x20, 0x07, 0x00, 0xff, 0x01, 0x01, 0x62, 0x23, 0x52, 0xff,
+        0x63, uint8_t(voltage >> 8), uint8_t(voltage), 0x01,
+        // listSignature, actGatewayTime, crc, endOfSmlMsg
+        0x01, 0x01, 0x63, 0x00, 0x00, 0x00,
+        // SML.PublicClose.Res
+        0x76, 0x05, 0x01, 0x02, 0x03, 0x06, 0x62, 0x00, 0x62, 0x00,
+        0x72, 0x63, 0x02, 0x01, 0x71, 0x01, 0x63, 0x00, 0x00, 0x00 };
+}
+
+struct SmlReader {
+    UARTComponent uart;
+    P1Reader reader{ &uart };
+    Sensor *energy{ reader.AddSensor(1, 8, 0) };
+    Sensor *power{ reader.AddSensor(16, 7, 0) };
+    Sensor *voltage{ reader.AddSensor(32, 7, 0) };
+    SmlReader()
+    {
+        energy->unit = "kWh";
+        power->unit = "W";
+        voltage->unit = "V";
+        reader.setup();
+        RunLoops(reader, 40);
+    }
+};
+
+static void TestValues()
+{
+    SmlReader meter;
+    SmlFile const file{ MakeSmlFile(GetListResponse(1234567, 1726, 2301)) };
+    CHECK(file.num_escapes == 0);
+    CHECK(file.num_padding_bytes != 0);
+    Feed(meter.uart, meter.reader, file.bytes);
+    CHECK_NEAR(meter.energy->state, 123.4567);
+    CHECK_NEAR(meter.power->state, 1726.0);
+    CHECK_NEAR(meter.voltage->state, 230.1);
+}
+
+// The register is 1b1b1b1b, which is sent twice, and the power is negative (export)
+static void TestEscapeAndSignedValue()
+{
+    SmlReader meter;
+    SmlFile const file{ MakeSmlFile(GetListResponse(0x1b1b1b1b, -1726, 2302)) };
+    CHECK(file.num_escapes == 1);
+    CHECK(file.num_padding_bytes != 0);
+    Feed(meter.uart, meter.reader, file.bytes);
+    CHECK_NEAR(meter.energy->state, 45476.1243);
+    CHECK_NEAR(meter.power->state, -1726.0);
+    CHECK_NEAR(meter.voltage->state, 230.2);
+}
+
+// A file with a bad CRC is ignored, and the next one is read as usual
+static void TestBadCrc()
+{
+    SmlReader meter;
+    Feed(meter.uart, meter.reader, MakeSmlFile(GetListResponse(1234567, 1726, 2301)).bytes);
+    SmlFile damaged{ MakeSmlFile(GetListResponse(0x1b1b1b1b, -1726, 2302)) };
+    damaged.bytes[damaged.bytes.size() - 1] ^= 0x80;
+    Feed(meter.uart, meter.reader, damaged.bytes, 100);
+    CHECK_NEAR(meter.energy->state, 123.4567);
+    CHECK_NEAR(meter.power->state, 1726.0);
+
+    Feed(meter.uart, meter.reader, MakeSmlFile(GetListResponse(1234600, -5, 2299)).bytes);
+    CHECK_NEAR(meter.energy->state, 123.46);
+    CHECK_NEAR(meter.power->state, -5.0);
+    CHECK_NEAR(meter.voltage->state, 229.9);
+}
+
+int main()
+{
+    TestValues();
+    TestEscapeAndSignedValue();
+    TestBadCrc();
+    return TestResult("sml_test");
+}